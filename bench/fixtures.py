@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Generate the synthetic fixtures of the benchmark suite.
+
+Each fixture is described by a spec KIND:SIZE and generated once in a cache
+directory, the next runs reuse it:
+  wide:N    one directory holding N empty files
+  deep:N    a chain of N nested directories, each holding one file
+  small:N   a 10 x 10 directory tree holding N small files in total
+  procfs:N  a fake procfs root with N processes, for myps --procfs
+  script:N  a mysh batch script running N commands
+"""
+
+import os
+import random
+import sys
+
+
+def gen_wide(path, size):
+    os.makedirs(path)
+    for i in range(size):
+        open(os.path.join(path, 'f%06d' % i), 'w').close()
+
+
+def gen_deep(path, size):
+    current = path
+    for i in range(size):
+        current = os.path.join(current, 'd')
+        os.makedirs(current)
+        open(os.path.join(current, 'f'), 'w').close()
+
+
+def gen_small(path, size):
+    per_dir = max(1, size // 100)
+    for i in range(10):
+        for j in range(10):
+            current = os.path.join(path, 'a%d' % i, 'b%d' % j)
+            os.makedirs(current)
+            for k in range(per_dir):
+                with open(os.path.join(current, 'f%d' % k), 'w') as f:
+                    f.write('x' * (k % 512))
+
+
+def stat_line(pid, ppid, name, rng):
+    # See proc(5), only the fields decoded by myps are meaningful.
+    utime, stime = rng.randrange(10000), rng.randrange(1000)
+    start = rng.randrange(100000)
+    vsize = rng.randrange(1 << 20, 1 << 32)
+    rss = rng.randrange(1, 1 << 16)
+    return ('%d (%s) S %d %d %d 0 -1 4194304 0 0 0 0 %d %d 0 0 20 0 1 0 %d %d %d '
+            '18446744073709551615 0 0 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0\n'
+            % (pid, name, ppid, pid, pid, utime, stime, start, vsize, rss))
+
+
+def gen_procfs(path, size):
+    rng = random.Random(size)
+    os.makedirs(path)
+    with open(os.path.join(path, 'uptime'), 'w') as f:
+        f.write('123456.78 234567.89\n')
+
+    for pid in range(1, size + 1):
+        # Parents are always older, like on a real system.
+        ppid = 0 if pid == 1 else rng.randrange(1, pid)
+        name = 'proc-%d' % (pid % 97)
+        threads = 1 + (pid % 4 == 0) * 3
+        proc = os.path.join(path, str(pid))
+        os.makedirs(os.path.join(proc, 'task'))
+        with open(os.path.join(proc, 'stat'), 'w') as f:
+            f.write(stat_line(pid, ppid, name, rng))
+        with open(os.path.join(proc, 'io'), 'w') as f:
+            f.write('rchar: 0\nwchar: 0\nsyscr: 0\nsyscw: 0\nread_bytes: %d\n'
+                    'write_bytes: %d\ncancelled_write_bytes: 0\n'
+                    % (rng.randrange(1 << 30), rng.randrange(1 << 30)))
+        for tid in range(threads):
+            tid = pid if tid == 0 else size + pid * 4 + tid
+            task = os.path.join(proc, 'task', str(tid))
+            os.makedirs(task)
+            with open(os.path.join(task, 'stat'), 'w') as f:
+                f.write(stat_line(tid, ppid, name, rng))
+
+
+def gen_script(path, size):
+    with open(path, 'w') as f:
+        for i in range(size):
+            f.write('true\n')
+
+
+GENERATORS = {
+    'wide': gen_wide,
+    'deep': gen_deep,
+    'small': gen_small,
+    'procfs': gen_procfs,
+    'script': gen_script,
+}
+
+
+def fixture(cache, spec):
+    """Return the path of the fixture, generating it if needed."""
+    kind, size = spec.split(':')
+    path = os.path.join(cache, '%s-%s' % (kind, size))
+    if not os.path.exists(path):
+        # Generate aside, so an interrupted run leaves no half fixture.
+        tmp = path + '.tmp'
+        if os.path.isdir(tmp):
+            import shutil
+            shutil.rmtree(tmp)
+        elif os.path.exists(tmp):
+            os.remove(tmp)
+        GENERATORS[kind](tmp, int(size))
+        os.rename(tmp, path)
+    return path
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit('usage: fixtures.py CACHE_DIR KIND:SIZE')
+    os.makedirs(sys.argv[1], exist_ok=True)
+    print(fixture(sys.argv[1], sys.argv[2]))
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Run one benchmark of the suite and report its cost.
+
+usage: run.py --spawn BENCH_SPAWN [--fixture KIND:SIZE] [--cache DIR]
+              [--runs N] -- COMMAND...
+
+Every {} in the command is replaced by the path of the fixture. The command
+runs once to warm the caches, then N times. The report gives the wall time
+(best and median), the syscalls of one run (with strace when it is
+installed, else the --stats instrumentation) and the peak RSS.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fixtures
+
+
+def run(spawn, command):
+    """Return the wall time (s) and the peak RSS (kB) of one run."""
+    result = subprocess.run([spawn] + command, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, check=True, text=True)
+    elapsed, rss = result.stderr.split()[-2:]
+    return int(elapsed) / 1e9, int(rss)
+
+
+def count_stats(command):
+    """Count the instrumented syscalls of one run with MYSH_STATS, or return
+    None if the commands are built without stats."""
+    with tempfile.NamedTemporaryFile('r') as out:
+        env = dict(os.environ, MYSH_STATS=out.name)
+        subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                       env=env, check=True)
+        reports = [json.loads(line) for line in out]
+    if not reports:
+        return None
+    calls = sum(kind['calls'] for report in reports
+                for kind in report['syscalls'].values())
+    return '%d instrumented' % calls
+
+
+def count_syscalls(command):
+    """Count the syscalls of one run with strace, or fall back on the
+    instrumentation of the commands."""
+    strace = shutil.which('strace')
+    if strace is None:
+        return count_stats(command)
+
+    with tempfile.NamedTemporaryFile('r') as out:
+        subprocess.run([strace, '-f', '-c', '-o', out.name] + command,
+                       stdout=subprocess.DEVNULL, check=True)
+        # The columns change between strace versions, and the empty ones
+        # (errors) are blank: the counts are right aligned under "calls".
+        calls_end = None
+        for line in out:
+            header = re.search(r'\bcalls\b', line)
+            if calls_end is None and header is not None:
+                calls_end = header.end()
+            elif calls_end is not None and line.split()[-1:] == ['total']:
+                for field in re.finditer(r'\S+', line):
+                    if field.end() == calls_end:
+                        return int(field.group())
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--fixture')
+    parser.add_argument('--cache', default='bench-fixtures')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--spawn', required=True,
+                        help='the bench-spawn helper built with the suite')
+    parser.add_argument('command', nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+
+    command = args.command[1:] if args.command[:1] == ['--'] else args.command
+    if args.fixture is not None:
+        os.makedirs(args.cache, exist_ok=True)
+        path = fixtures.fixture(args.cache, args.fixture)
+        command = [arg.replace('{}', path) for arg in command]
+
+    run(args.spawn, command)
+    results = [run(args.spawn, command) for _ in range(args.runs)]
+    times = [elapsed for elapsed, _ in results]
+    peak_rss = max(rss for _, rss in results)
+    syscalls = count_syscalls(command)
+
+    name = ' '.join([os.path.basename(command[0])] + command[1:])
+    print('%s: best %.2f ms, median %.2f ms, syscalls %s, peak RSS %d kB'
+          % (name, min(times) * 1000, statistics.median(times) * 1000,
+             'n/a' if syscalls is None else syscalls, peak_rss))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,40 +1,583 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dir_iter.h"
+#include "stats.h"
+
+#define MAX_JOBS 8
+// Upper bound of the queued directories, which keep their fd open. Half of
+// the fds are left to the directories being walked.
+#define MAX_QUEUED_DIRS 65536
+#define MAX_MODE_CLAUSES 16
+#define PERM_BITS 07777
+
+// Linux 6.6, same number on every architecture.
+#ifndef SYS_fchmodat2
+#define SYS_fchmodat2 452
+#endif
 
 struct option longopts [] = {
     {"help", no_argument, 0, 'h'},
     {"verbose", no_argument, 0, 'v'},
     {"changes", no_argument, 0, 'c'},
+    {"recursive", no_argument, 0, 'R'},
+    {"dereference-args", no_argument, 0, 'H'},
+    {"jobs", required_argument, 0, 'j'},
+    {"files-from", required_argument, 0, 'f'},
+    STATS_LONGOPT,
     {0,0,0,0}
 };
 
+// One operation of a mode, such as "go-w", compiled into masks. The new mode
+// is (mode & and_mask) | or_mask, then exec_bits (from X) are added or
+// removed for directories and files executable by someone.
+struct mode_clause {
+    mode_t and_mask;
+    mode_t or_mask;
+    mode_t exec_bits;
+    int exec_clear;
+};
+
+// A full mode, like "u+x,go-w" or "0644".
+struct mode_change {
+    struct mode_clause clauses[MAX_MODE_CLAUSES];
+    int size;
+};
+
+// What to change and how to report it.
+struct chmod_opts {
+    struct mode_change change;
+    int verbose;
+    int changes;
+    int recursive;
+    int follow_args; // Follow the symbolic links given as arguments.
+};
+
+// Directory waiting to be walked, its mode is already changed.
+struct dir_job {
+    int fd;
+    char *path;
+};
+
+// Directories shared by the workers of the pool.
+struct work_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_job *jobs;
+    int size;
+    int capacity;
+    int busy; // Workers walking a directory, which may queue more.
+    int max_size; // Above it, the workers descend themselves instead.
+};
+
+struct chmod_opts OPTS;
+struct work_queue QUEUE = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+int FAILED = 0;
+int HAS_FCHMODAT2 = 1;
+
+// ********** Mode functions **********
+
+// Compile an octal (e.g. 644, 0755) or symbolic (e.g. u+x,go-w,a=rX) mode.
+// Return -1 if the mode is invalid.
+int compile_mode(const char *str, struct mode_change *change) {
+    change->size = 0;
+
+    // Octal mode.
+    if (*str >= '0' && *str <= '7') {
+        char *end;
+        long mode = strtol(str, &end, 8);
+        if (*end != '\0' || strlen(str) > 4) { return -1; }
+        change->clauses[0] = (struct mode_clause) { .and_mask = 0, .or_mask = mode };
+        change->size = 1;
+        return 0;
+    }
+
+    mode_t umask_bits = umask(0);
+    umask(umask_bits);
+
+    const char *c = str;
+    while (1) {
+        // Who, all of them if none is given, but then the umask is respected.
+        mode_t who = 0;
+        for ( ; *c == 'u' || *c == 'g' || *c == 'o' || *c == 'a'; c++) {
+            if (*c == 'u') { who |= S_ISUID | S_IRWXU; }
+            if (*c == 'g') { who |= S_ISGID | S_IRWXG; }
+            if (*c == 'o') { who |= S_ISVTX | S_IRWXO; }
+            if (*c == 'a') { who |= PERM_BITS; }
+        }
+        mode_t affected = who != 0 ? who : PERM_BITS & ~umask_bits;
+        if (who == 0) { who = PERM_BITS; }
+
+        // One or more operations.
+        if (*c != '+' && *c != '-' && *c != '=') { return -1; }
+        while (*c == '+' || *c == '-' || *c == '=') {
+            char op = *c++;
+            mode_t bits = 0;
+            mode_t exec_bits = 0;
+            for ( ; *c != '\0' && *c != ',' && *c != '+' && *c != '-' && *c != '='; c++) {
+                switch (*c) {
+                    case 'r': bits |= S_IRUSR | S_IRGRP | S_IROTH; break;
+                    case 'w': bits |= S_IWUSR | S_IWGRP | S_IWOTH; break;
+                    case 'x': bits |= S_IXUSR | S_IXGRP | S_IXOTH; break;
+                    case 'X': exec_bits |= S_IXUSR | S_IXGRP | S_IXOTH; break;
+                    case 's': bits |= S_ISUID | S_ISGID; break;
+                    case 't': bits |= S_ISVTX; break;
+                    default: return -1;
+                }
+            }
+            if (change->size == MAX_MODE_CLAUSES) { return -1; }
+
+            struct mode_clause *clause = &change->clauses[change->size++];
+            clause->and_mask = PERM_BITS;
+            clause->or_mask = 0;
+            clause->exec_bits = exec_bits & affected;
+            clause->exec_clear = op == '-';
+            if (op == '-') {
+                clause->and_mask = ~(bits & affected) & PERM_BITS;
+            } else {
+                clause->or_mask = bits & affected;
+                if (op == '=') {
+                    clause->and_mask = ~who & PERM_BITS;
+                }
+            }
+        }
+
+        if (*c == '\0') { return 0; }
+        // Next clause.
+        c++;
+    }
+}
+
+// Compute the new permission bits of a file from its current st_mode.
+mode_t apply_mode(struct mode_change *change, mode_t st_mode) {
+    mode_t mode = st_mode & PERM_BITS;
+
+    for (int i = 0; i < change->size; i++) {
+        struct mode_clause *clause = &change->clauses[i];
+        int executable = S_ISDIR(st_mode) || (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+
+        mode = (mode & clause->and_mask) | clause->or_mask;
+        if (executable && clause->exec_clear) {
+            mode &= ~clause->exec_bits;
+        } else if (executable) {
+            mode |= clause->exec_bits;
+        }
+    }
+    return mode;
+}
+
+void report_error(const char *path) {
+    fprintf(stderr, "mychmod: cannot change %s: %s\n", path, strerror(errno));
+    __atomic_store_n(&FAILED, 1, __ATOMIC_RELAXED);
+}
+
+void report_before(const char *path, mode_t mode) {
+    if (OPTS.verbose) {
+        printf("the file %s will be given a %04o authorization \n", path, mode);
+    }
+}
+
+void report_after(const char *path, mode_t mode) {
+    if (OPTS.changes) {
+        printf("the file %s has been given a %04o authorization \n", path, mode);
+    }
+}
+
+// Tell whether the mode has to be written, reporting the files left as they
+// are: an unchanged mode must not dirty the inode.
+int needs_change(const char *path, mode_t st_mode, mode_t mode) {
+    if ((st_mode & PERM_BITS) != mode) {
+        report_before(path, mode);
+        return 1;
+    }
+    if (OPTS.verbose) {
+        printf("the file %s keeps its %04o authorization \n", path, mode);
+    }
+    return 0;
+}
+
+// Change the mode of name, relative to dir_fd, following it only if follow
+// is set. Without following, a link is refused with EOPNOTSUPP: the entry may
+// have been replaced by one since it was checked. fchmodat2() does it in the
+// kernel, older kernels get the emulation of the libc, through /proc.
+int chmod_at(int dir_fd, const char *name, mode_t mode, int follow) {
+    if (follow) {
+        return fchmodat(dir_fd, name, mode, 0);
+    }
+    if (__atomic_load_n(&HAS_FCHMODAT2, __ATOMIC_RELAXED)) {
+        int ret = syscall(SYS_fchmodat2, dir_fd, name, mode, AT_SYMLINK_NOFOLLOW);
+        if (ret == 0 || errno != ENOSYS) { return ret; }
+        __atomic_store_n(&HAS_FCHMODAT2, 0, __ATOMIC_RELAXED);
+    }
+    return fchmodat(dir_fd, name, mode, AT_SYMLINK_NOFOLLOW);
+}
+
+// Change the mode of name, relative to dir_fd, from its current st_mode.
+// Symbolic links are only followed with follow, the arguments of -H.
+void change_at(int dir_fd, const char *name, const char *path, mode_t st_mode, int follow) {
+    mode_t mode = apply_mode(&OPTS.change, st_mode);
+    if (! needs_change(path, st_mode, mode)) { return; }
+
+    if (STATS(STATS_CHMOD, chmod_at(dir_fd, name, mode, follow)) == -1) {
+        if (errno != EOPNOTSUPP) {
+            report_error(path);
+        } else if (OPTS.verbose) {
+            // Replaced by a link since its stat.
+            printf("the symbolic link %s is not followed \n", path);
+        }
+        return;
+    }
+    report_after(path, mode);
+}
+
+// Change the mode of an open directory.
+int change_fd(int fd, const char *path) {
+    struct stat sb;
+    if (STATS(STATS_STAT, fstat(fd, &sb)) == -1) {
+        report_error(path);
+        return -1;
+    }
+
+    mode_t mode = apply_mode(&OPTS.change, sb.st_mode);
+    if (! needs_change(path, sb.st_mode, mode)) { return 0; }
+
+    if (STATS(STATS_CHMOD, fchmod(fd, mode)) == -1) {
+        report_error(path);
+        return -1;
+    }
+    report_after(path, mode);
+    return 0;
+}
+
+// ********** Walk functions **********
+
+void queue_push(int fd, char *path) {
+    if (QUEUE.size == QUEUE.capacity) {
+        QUEUE.capacity = QUEUE.capacity == 0 ? 64 : QUEUE.capacity * 2;
+        QUEUE.jobs = realloc(QUEUE.jobs, QUEUE.capacity * sizeof(struct dir_job));
+    }
+    QUEUE.jobs[QUEUE.size].fd = fd;
+    QUEUE.jobs[QUEUE.size].path = path;
+    QUEUE.size++;
+    pthread_cond_signal(&QUEUE.cond);
+}
+
+// Raise the soft limit of open fds to the hard one, and size the queue from
+// what is available.
+void init_queue_limit(void) {
+    struct rlimit limit;
+    QUEUE.max_size = 256;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) { return; }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    QUEUE.max_size = limit.rlim_cur / 2 < MAX_QUEUED_DIRS ? limit.rlim_cur / 2 : MAX_QUEUED_DIRS;
+}
+
+void walk_dir(int fd, const char *path, struct dir_iter *it);
+
+// Open a directory, without following symbolic links unless follow is set.
+// When the fds run out anyway (the limit is shared with the rest of the
+// process, and the descents in place hold one per level), queued directories
+// are walked right away to close theirs.
+int open_child(int fd, const char *name, int follow) {
+    while (1) {
+        // O_NOFOLLOW: the directory may have been replaced by a link.
+        int child_fd = STATS(STATS_OPEN,
+                openat(fd, name, O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW)));
+        if (child_fd != -1 || errno != EMFILE) { return child_fd; }
+
+        pthread_mutex_lock(&QUEUE.lock);
+        if (QUEUE.size == 0) {
+            pthread_mutex_unlock(&QUEUE.lock);
+            errno = EMFILE;
+            return -1;
+        }
+        struct dir_job job = QUEUE.jobs[--QUEUE.size];
+        pthread_mutex_unlock(&QUEUE.lock);
+
+        struct dir_iter job_it = { .buf = NULL };
+        walk_dir(job.fd, job.path, &job_it);
+        dir_iter_free(&job_it);
+        free(job.path);
+    }
+}
+
+// Hand an open directory to the pool, or walk it right away with its own
+// iterator when the queue is full.
+void queue_or_walk(int fd, const char *path) {
+    pthread_mutex_lock(&QUEUE.lock);
+    int queued = QUEUE.size < QUEUE.max_size;
+    if (queued) {
+        queue_push(fd, strdup(path));
+    }
+    pthread_mutex_unlock(&QUEUE.lock);
+    if (! queued) {
+        struct dir_iter it = { .buf = NULL };
+        walk_dir(fd, path, &it);
+        dir_iter_free(&it);
+    }
+}
+
+// Join a directory path and an entry name in a growing buffer.
+char* join_path(char **buf, size_t *buf_size, const char *dir, const char *name) {
+    size_t needed = strlen(dir) + strlen(name) + 2;
+    if (needed > *buf_size) {
+        *buf_size = needed * 2;
+        *buf = realloc(*buf, *buf_size);
+    }
+    snprintf(*buf, *buf_size, "%s/%s", dir, name);
+    return *buf;
+}
+
+// Change the mode of every entry of an open directory. The subdirectories are
+// opened without following symbolic links, changed, then handed to the pool,
+// or walked right away when the queue is already full. The iterator buffer is
+// reused and the fd is closed.
+void walk_dir(int fd, const char *path, struct dir_iter *it) {
+    char *child_path = NULL;
+    size_t child_path_size = 0;
+    struct linux_dirent64 *d;
+
+    dir_iter_reset(it, fd, DIR_ITER_SKIP_DOTS);
+    while ((d = dir_iter_next(it)) != NULL) {
+        join_path(&child_path, &child_path_size, path, d->d_name);
+
+        // Links are skipped without any other syscall.
+        if (d->d_type == DT_LNK) { continue; }
+        if (d->d_type != DT_DIR) {
+            // Only the type and mode are needed to compare.
+            struct statx stx;
+            if (STATS(STATS_STAT, statx(fd, d->d_name, AT_SYMLINK_NOFOLLOW,
+                            STATX_TYPE | STATX_MODE, &stx)) == -1) {
+                report_error(child_path);
+                continue;
+            }
+            if (S_ISLNK(stx.stx_mode)) { continue; }
+            if (! S_ISDIR(stx.stx_mode)) {
+                change_at(fd, d->d_name, child_path, stx.stx_mode, 0);
+                continue;
+            }
+            // A directory on a filesystem that doesn't fill d_type.
+        }
+
+        int child_fd = open_child(fd, d->d_name, 0);
+        if (child_fd == -1) {
+            if (errno != ELOOP && errno != ENOTDIR) {
+                report_error(child_path);
+            }
+            continue;
+        }
+        if (change_fd(child_fd, child_path) == -1) {
+            close(child_fd);
+            continue;
+        }
+
+        // The buffer still holds the rest of this directory.
+        queue_or_walk(child_fd, child_path);
+    }
+    if (it->error != 0) {
+        errno = it->error;
+        report_error(path);
+    }
+    free(child_path);
+    close(fd);
+}
+
+// Worker of the pool: walk the queued directories until none is left and no
+// other worker can queue more.
+void* chmod_worker(void *arg) {
+    (void) arg;
+    struct dir_iter it = { .buf = NULL };
+
+    pthread_mutex_lock(&QUEUE.lock);
+    while (1) {
+        while (QUEUE.size == 0 && QUEUE.busy > 0) {
+            pthread_cond_wait(&QUEUE.cond, &QUEUE.lock);
+        }
+        if (QUEUE.size == 0) { break; }
+
+        struct dir_job job = QUEUE.jobs[--QUEUE.size];
+        QUEUE.busy++;
+        pthread_mutex_unlock(&QUEUE.lock);
+
+        walk_dir(job.fd, job.path, &it);
+        free(job.path);
+
+        pthread_mutex_lock(&QUEUE.lock);
+        QUEUE.busy--;
+    }
+    // Wake up the other workers, the walk is over.
+    pthread_cond_broadcast(&QUEUE.cond);
+    pthread_mutex_unlock(&QUEUE.lock);
+
+    dir_iter_free(&it);
+    return NULL;
+}
+
+// Walk the queued directories on jobs threads.
+void run_workers(int jobs) {
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+
+    if (QUEUE.size == 0) { return; }
+    for ( ; started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, chmod_worker, NULL) != 0) {
+            break;
+        }
+    }
+    // The calling thread is one of the workers.
+    chmod_worker(NULL);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Change the mode of a path given by the user, and queue it if it is a
+// directory to walk, or walk it now if the queue is full.
+void chmod_path(char *path) {
+    int nofollow = OPTS.follow_args ? 0 : AT_SYMLINK_NOFOLLOW;
+    struct stat sb;
+
+    if (STATS(STATS_STAT, fstatat(AT_FDCWD, path, &sb, nofollow)) == -1) {
+        report_error(path);
+        return;
+    }
+    if (S_ISLNK(sb.st_mode)) {
+        if (OPTS.verbose) {
+            printf("the symbolic link %s is not followed \n", path);
+        }
+        return;
+    }
+    if (! OPTS.recursive || ! S_ISDIR(sb.st_mode)) {
+        change_at(AT_FDCWD, path, path, sb.st_mode, OPTS.follow_args);
+        return;
+    }
+
+    int fd = open_child(AT_FDCWD, path, OPTS.follow_args);
+    if (fd == -1) {
+        report_error(path);
+        return;
+    }
+    if (change_fd(fd, path) == -1) {
+        close(fd);
+        return;
+    }
+    // The pool only runs once all the arguments are read.
+    queue_or_walk(fd, path);
+}
+
+// Change the mode of the paths listed one per line in a file, - for stdin.
+void chmod_files_from(char *file) {
+    FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mychmod: cannot read %s: %s\n", file, strerror(errno));
+        FAILED = 1;
+        return;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') { line[--len] = '\0'; }
+        if (len == 0) { continue; }
+        chmod_path(line);
+    }
+    free(line);
+    if (f != stdin) { fclose(f); }
+}
+
+// Take a mode starting with '-' (e.g. -w or -x,o+r) out of argv before
+// getopt reads it as options, like GNU chmod: it is the first argument that
+// is not an option. Return NULL if the mode doesn't start with '-'.
+char* take_dash_mode(int *argc, char *argv[]) {
+    struct mode_change change;
+    for (int i = 1; i < *argc; i++) {
+        char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0' || strcmp(arg, "--") == 0) { return NULL; }
+        if (compile_mode(arg, &change) == 0) {
+            // With the NULL at the end of argv.
+            memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+            (*argc)--;
+            return arg;
+        }
+
+        // Skip the argument of -j and --files-from given apart.
+        char *jobs = strchr(arg, 'j');
+        if (strcmp(arg, "--jobs") == 0 || strcmp(arg, "--files-from") == 0 ||
+                (arg[1] != '-' && jobs != NULL && jobs[1] == '\0')) {
+            i++;
+        }
+    }
+    return NULL;
+}
+
 int main (int argc, char *argv[]) {
 
-    int v = 0;
-    int c = 0;
     int i = 0;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *files_from = NULL;
 
+    stats_init(argv[0]);
+    char *permission = take_dash_mode(&argc, argv);
 
-    while ((i = getopt_long(argc, argv, "hvc", longopts, NULL)) != -1){
+    while ((i = getopt_long(argc, argv, "hvcRHj:", longopts, NULL)) != -1){
 
         switch (i){
 
             case 'h':
-              printf("usage: chmod[OPTION]... MODE[MODE]...file ...\n" \
+              printf("usage: chmod [OPTION]... MODE FILE...\n" \
+                      "       chmod [OPTION]... MODE --files-from FILE\n" \
+                      "  MODE is octal (0644) or symbolic ([ugoa]*[+-=][rwxXst]*, comma separated).\n" \
+                      "  A MODE starting with '-', like -w, can be given before or after the options.\n" \
                       "  ----- Options -----\n" \
                       "  -v\tWarns what will be made and when action is done.\n" \
-                      "  -c\tTells what has been made once the action is completed.\n");
+                      "  -c\tTells what has been made once the action is completed, only for\n" \
+                      "    \tthe files whose mode really changed.\n" \
+                      "  -R\tChange the directories and their contents recursively.\n" \
+                      "  -H\tFollow the symbolic links given as arguments.\n" \
+                      "  -j\tWalk the directories with jobs threads.\n" \
+                      "  --files-from\tRead the files, one per line, from FILE (- for stdin).\n" \
+                      "  --stats\tReport the syscall counts and latencies as JSON at exit.\n");
                 return EXIT_SUCCESS;
             case 'v':
-                v = 1;
+                OPTS.verbose = 1;
                 break;
             case 'c':
-                c = 1;
+                OPTS.changes = 1;
+                break;
+            case 'R':
+                OPTS.recursive = 1;
+                break;
+            case 'H':
+                OPTS.follow_args = 1;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'f':
+                files_from = optarg;
+                break;
+            case STATS_OPT:
+                stats_enable(optarg);
                 break;
             case ':':
                 // Missing option argument
@@ -46,42 +589,34 @@ int main (int argc, char *argv[]) {
             break;
         }
     }
-    if (argc < 3){
+    if (permission == NULL && optind < argc) {
+        permission = argv[optind++];
+    }
+    if (permission == NULL || (optind >= argc && files_from == NULL)) {
       fprintf(stderr, "chmod error\n");
       exit(EXIT_FAILURE);
     }
+    if (jobs < 1) { jobs = 1; }
+    if (jobs > MAX_JOBS) { jobs = MAX_JOBS; }
+    init_queue_limit();
 
-    char *permission = argv[optind];
-    char *buf = argv[optind+1];
-    int x;
-
-    if ((strlen(permission) != 4) | ((permission[0] - '0') != 0) | ((permission[1] - '0') > 7)
-            | ((permission[2] - '0') > 7) | ((permission[3]  - '0' )> 7)) {
-        printf("%c\n", permission[3]);
+    if (compile_mode(permission, &OPTS.change) == -1) {
+        printf("%s\n", permission);
         printf("input error \n");
         exit(EXIT_FAILURE);
     }
 
-    if(buf == NULL){
-        printf("no path entered \n");
-    }
-
-    if (v == 1){
-        printf("the file %s will be given a %s authorization \n", argv[3], argv[2]);
+    for (int arg = optind; arg < argc; arg++) {
+        chmod_path(argv[arg]);
     }
-
-    x = strtol(permission, 0, 8);
-    if(chmod (buf,x) < 0){
-        fprintf(stderr, "chmod error\n");
-        exit(EXIT_FAILURE);
+    if (files_from != NULL) {
+        chmod_files_from(files_from);
     }
+    run_workers(jobs);
 
-    if (v == 1){
+    if (OPTS.verbose == 1){
         printf("operation completed \n");
     }
 
-    if (c == 1){
-        printf("the file %s has been given a %s authorization \n", argv[3], argv[2]);
-    }
-    return EXIT_SUCCESS;
+    return FAILED ? EXIT_FAILURE : EXIT_SUCCESS;
 }
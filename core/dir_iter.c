@@ -0,0 +1,75 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dir_iter.h"
+#include "stats.h"
+
+void dir_iter_init(struct dir_iter *it, int fd, int flags) {
+    it->buf = NULL;
+    dir_iter_reset(it, fd, flags);
+}
+
+void dir_iter_reset(struct dir_iter *it, int fd, int flags) {
+    if (it->buf == NULL) {
+        it->buf = malloc(DIR_ITER_BUF_SIZE);
+    }
+    it->fd = fd;
+    it->flags = flags;
+    it->nread = 0;
+    it->bpos = 0;
+    it->error = 0;
+
+    if (flags & DIR_ITER_REWIND) {
+        lseek(fd, 0, SEEK_SET);
+    }
+}
+
+struct linux_dirent64* dir_iter_next(struct dir_iter *it) {
+    while (1) {
+        if (it->bpos >= it->nread) {
+            it->nread = STATS(STATS_GETDENTS,
+                    syscall(SYS_getdents64, it->fd, it->buf, DIR_ITER_BUF_SIZE));
+            it->bpos = 0;
+            if (it->nread <= 0) {
+                // End of the directory, or error.
+                if (it->nread == -1) {
+                    it->error = errno;
+                }
+                it->nread = 0;
+                return NULL;
+            }
+        }
+
+        struct linux_dirent64 *d = (struct linux_dirent64 *) (it->buf + it->bpos);
+        it->bpos += d->d_reclen;
+
+        if ((it->flags & DIR_ITER_SKIP_DOTS) && d->d_name[0] == '.' &&
+                (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+            continue;
+        }
+        return d;
+    }
+}
+
+unsigned char dir_entry_type(int dir_fd, struct linux_dirent64 *d) {
+    if (d->d_type != DT_UNKNOWN) {
+        return d->d_type;
+    }
+
+    struct stat sb;
+    if (STATS(STATS_STAT, fstatat(dir_fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW)) == -1) {
+        return DT_UNKNOWN;
+    }
+    return IFTODT(sb.st_mode);
+}
+
+void dir_iter_free(struct dir_iter *it) {
+    free(it->buf);
+    it->buf = NULL;
+}
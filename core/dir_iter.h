@@ -0,0 +1,49 @@
+#ifndef MYSH_DIR_ITER_H
+#define MYSH_DIR_ITER_H
+
+#include <sys/types.h>
+
+// Size of the getdents64 buffer, a few hundred entries per syscall.
+#define DIR_ITER_BUF_SIZE 65536
+
+// Flags of dir_iter_init() and dir_iter_reset().
+#define DIR_ITER_SKIP_DOTS 1 // Don't return "." and "..".
+#define DIR_ITER_REWIND    2 // Seek back to the start, the fd was listed already.
+
+// Directory entry of getdents64.
+struct linux_dirent64 {
+    ino_t          d_ino;
+    off_t          d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+// Iterator over the entries of a directory fd. The buffer is allocated once
+// and can be reused for other directories with dir_iter_reset().
+struct dir_iter {
+    int fd;
+    int flags;
+    int nread;
+    int bpos;
+    int error; // errno of a failed getdents64, 0 otherwise.
+    char *buf;
+};
+
+// Start iterating over an open directory fd, which stays owned by the caller.
+void dir_iter_init(struct dir_iter *it, int fd, int flags);
+
+// Iterate over another directory, keeping the buffer.
+void dir_iter_reset(struct dir_iter *it, int fd, int flags);
+
+// Get the next entry, or NULL at the end of the directory or on error.
+struct linux_dirent64* dir_iter_next(struct dir_iter *it);
+
+// Type of an entry, from d_type or with fstatat() on the filesystems that
+// don't fill it.
+unsigned char dir_entry_type(int dir_fd, struct linux_dirent64 *d);
+
+// Free the buffer, the fd is not closed.
+void dir_iter_free(struct dir_iter *it);
+
+#endif
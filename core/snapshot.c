@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "stats.h"
+
+#define ALIGN8(X) (((X) + 7) & ~(uint64_t) 7)
+
+// ********** Writer **********
+
+void snapshot_writer_init(struct snapshot_writer *w) {
+    memset(w, 0, sizeof(struct snapshot_writer));
+}
+
+// Make room for len more bytes in the names section.
+static void reserve_names(struct snapshot_writer *w, size_t len) {
+    if (w->names_size + len > w->names_capacity) {
+        w->names_capacity = (w->names_size + len) * 2;
+        w->names = realloc(w->names, w->names_capacity);
+    }
+}
+
+static void put_varint(struct snapshot_writer *w, uint64_t value) {
+    reserve_names(w, 10);
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        w->names[w->names_size++] = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+}
+
+void snapshot_add(struct snapshot_writer *w, const char *name, uint32_t depth,
+        uint8_t type, uint64_t size, uint32_t mode) {
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity == 0 ? 1024 : w->capacity * 2;
+        w->depth = realloc(w->depth, w->capacity * sizeof(uint32_t));
+        w->type = realloc(w->type, w->capacity * sizeof(uint8_t));
+        w->size = realloc(w->size, w->capacity * sizeof(uint64_t));
+        w->mode = realloc(w->mode, w->capacity * sizeof(uint32_t));
+        w->restart = realloc(w->restart, (w->capacity / SNAPSHOT_RESTART + 1) * sizeof(uint64_t));
+    }
+    w->depth[w->count] = depth;
+    w->type[w->count] = type;
+    w->size[w->count] = size;
+    w->mode[w->count] = mode;
+
+    size_t len = strlen(name);
+    size_t prefix = 0;
+    if (w->count % SNAPSHOT_RESTART == 0) {
+        w->restart[w->count / SNAPSHOT_RESTART] = w->names_size;
+    } else {
+        while (prefix < len && prefix < w->last_len && name[prefix] == w->last_name[prefix]) {
+            prefix++;
+        }
+    }
+    put_varint(w, prefix);
+    put_varint(w, len - prefix);
+    reserve_names(w, len - prefix);
+    memcpy(w->names + w->names_size, name + prefix, len - prefix);
+    w->names_size += len - prefix;
+
+    if (len + 1 > w->last_capacity) {
+        w->last_capacity = (len + 1) * 2;
+        w->last_name = realloc(w->last_name, w->last_capacity);
+    }
+    memcpy(w->last_name, name, len + 1);
+    w->last_len = len;
+    w->count++;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *c = buf;
+    while (len > 0) {
+        ssize_t n = STATS(STATS_WRITE, write(fd, c, len));
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write a section and pad it to the next multiple of 8.
+static int write_section(int fd, const void *buf, size_t len) {
+    static const char zeros[8] = { 0 };
+    if (write_all(fd, buf, len) == -1) { return -1; }
+    return write_all(fd, zeros, ALIGN8(len) - len);
+}
+
+int snapshot_write(struct snapshot_writer *w, int fd) {
+    struct snapshot_header h = { 0 };
+    uint64_t restarts = (w->count + SNAPSHOT_RESTART - 1) / SNAPSHOT_RESTART;
+
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.count = w->count;
+    h.depth_offset = ALIGN8(sizeof(struct snapshot_header));
+    h.type_offset = h.depth_offset + ALIGN8(w->count * sizeof(uint32_t));
+    h.size_offset = h.type_offset + ALIGN8(w->count * sizeof(uint8_t));
+    h.mode_offset = h.size_offset + ALIGN8(w->count * sizeof(uint64_t));
+    h.names_offset = h.mode_offset + ALIGN8(w->count * sizeof(uint32_t));
+    h.names_size = w->names_size;
+    h.restart_offset = h.names_offset + ALIGN8(w->names_size);
+
+    if (write_section(fd, &h, sizeof(h)) == -1 ||
+            write_section(fd, w->depth, w->count * sizeof(uint32_t)) == -1 ||
+            write_section(fd, w->type, w->count * sizeof(uint8_t)) == -1 ||
+            write_section(fd, w->size, w->count * sizeof(uint64_t)) == -1 ||
+            write_section(fd, w->mode, w->count * sizeof(uint32_t)) == -1 ||
+            write_section(fd, w->names, w->names_size) == -1 ||
+            write_section(fd, w->restart, restarts * sizeof(uint64_t)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_writer_free(struct snapshot_writer *w) {
+    free(w->depth);
+    free(w->type);
+    free(w->size);
+    free(w->mode);
+    free(w->restart);
+    free(w->names);
+    free(w->last_name);
+}
+
+// ********** Reader **********
+
+// Check that a section of count items of item_size bytes is in the file.
+static int section_ok(size_t map_size, uint64_t offset, uint64_t count, size_t item_size) {
+    if (offset % 8 != 0 || offset > map_size) { return 0; }
+    return count <= (map_size - offset) / item_size;
+}
+
+int snapshot_open(struct snapshot *s, const char *path) {
+    struct stat sb;
+    int fd = STATS(STATS_OPEN, open(path, O_RDONLY | O_CLOEXEC));
+    if (fd == -1) { return -1; }
+    if (STATS(STATS_STAT, fstat(fd, &sb)) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) sb.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    s->map_size = sb.st_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) { return -1; }
+
+    const struct snapshot_header *h = s->map;
+    uint64_t restarts = h->count / SNAPSHOT_RESTART + (h->count % SNAPSHOT_RESTART != 0);
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+            ! section_ok(s->map_size, h->depth_offset, h->count, sizeof(uint32_t)) ||
+            ! section_ok(s->map_size, h->type_offset, h->count, sizeof(uint8_t)) ||
+            ! section_ok(s->map_size, h->size_offset, h->count, sizeof(uint64_t)) ||
+            ! section_ok(s->map_size, h->mode_offset, h->count, sizeof(uint32_t)) ||
+            ! section_ok(s->map_size, h->names_offset, h->names_size, 1) ||
+            ! section_ok(s->map_size, h->restart_offset, restarts, sizeof(uint64_t))) {
+        snapshot_close(s);
+        errno = EINVAL;
+        return -1;
+    }
+
+    const char *base = s->map;
+    s->count = h->count;
+    s->depth = (const uint32_t *) (base + h->depth_offset);
+    s->type = (const uint8_t *) (base + h->type_offset);
+    s->size = (const uint64_t *) (base + h->size_offset);
+    s->mode = (const uint32_t *) (base + h->mode_offset);
+    s->names = (const unsigned char *) (base + h->names_offset);
+    s->names_size = h->names_size;
+    s->restart = (const uint64_t *) (base + h->restart_offset);
+    return 0;
+}
+
+void snapshot_close(struct snapshot *s) {
+    munmap(s->map, s->map_size);
+    s->map = NULL;
+}
+
+void snapshot_cursor_init(struct snapshot_cursor *c, const struct snapshot *s,
+        uint64_t index) {
+    c->s = s;
+    c->index = index - index % SNAPSHOT_RESTART;
+    c->pos = c->index < s->count ? s->restart[c->index / SNAPSHOT_RESTART] : s->names_size;
+    c->name = NULL;
+    c->len = 0;
+    c->capacity = 0;
+}
+
+// Decode a varint of the names section, return -1 past its end.
+static int get_varint(struct snapshot_cursor *c, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (c->pos >= c->s->names_size) { return -1; }
+        unsigned char byte = c->s->names[c->pos++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (! (byte & 0x80)) { return 0; }
+    }
+    return -1;
+}
+
+const char* snapshot_cursor_next(struct snapshot_cursor *c) {
+    uint64_t prefix, suffix;
+    if (c->index >= c->s->count) { return NULL; }
+    if (get_varint(c, &prefix) == -1 || get_varint(c, &suffix) == -1 ||
+            prefix > c->len || suffix > c->s->names_size - c->pos) {
+        return NULL;
+    }
+
+    if (prefix + suffix + 1 > c->capacity) {
+        c->capacity = (prefix + suffix + 1) * 2;
+        c->name = realloc(c->name, c->capacity);
+    }
+    memcpy(c->name + prefix, c->s->names + c->pos, suffix);
+    c->pos += suffix;
+    c->len = prefix + suffix;
+    c->name[c->len] = '\0';
+    c->index++;
+    return c->name;
+}
+
+void snapshot_cursor_free(struct snapshot_cursor *c) {
+    free(c->name);
+    c->name = NULL;
+}
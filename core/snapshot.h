@@ -0,0 +1,110 @@
+#ifndef MYSH_SNAPSHOT_H
+#define MYSH_SNAPSHOT_H
+
+// Binary snapshots of a directory tree, written by mytree and myls with
+// --format=bin and compared by mytree --diff.
+//
+// The entries are stored in preorder, the siblings sorted by name, with the
+// root at depth 0. The file is a header followed by one section per column,
+// each aligned on 8 bytes, so it can be used straight from mmap():
+//   depth   uint32_t[count]
+//   type    uint8_t[count]   DT_* of dirent.h
+//   size    uint64_t[count]  st_size
+//   mode    uint32_t[count]  st_mode
+//   names   front coded: for each entry, varint length of the prefix shared
+//           with the previous name, varint length of the suffix, suffix bytes.
+//           Every SNAPSHOT_RESTART entries the prefix is 0.
+//   restart uint64_t[(count + SNAPSHOT_RESTART - 1) / SNAPSHOT_RESTART]
+//           offsets of these full names in the names section.
+// The integers are in the byte order of the host, a snapshot from another
+// byte order is rejected by its magic.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC 0x31504e534853594dULL // "MYSHSNP1" on little endian hosts.
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_RESTART 16
+
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t depth_offset;
+    uint64_t type_offset;
+    uint64_t size_offset;
+    uint64_t mode_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t restart_offset;
+};
+
+// Columns being built in memory, see snapshot_add().
+struct snapshot_writer {
+    uint64_t count;
+    uint64_t capacity;
+    uint32_t *depth;
+    uint8_t *type;
+    uint64_t *size;
+    uint32_t *mode;
+    uint64_t *restart;
+    unsigned char *names;
+    size_t names_size;
+    size_t names_capacity;
+    char *last_name;
+    size_t last_len;
+    size_t last_capacity;
+};
+
+void snapshot_writer_init(struct snapshot_writer *w);
+
+// Append an entry, in preorder.
+void snapshot_add(struct snapshot_writer *w, const char *name, uint32_t depth,
+        uint8_t type, uint64_t size, uint32_t mode);
+
+// Write the snapshot to fd. Return -1 with errno set on error.
+int snapshot_write(struct snapshot_writer *w, int fd);
+
+void snapshot_writer_free(struct snapshot_writer *w);
+
+// Snapshot mapped in memory.
+struct snapshot {
+    void *map;
+    size_t map_size;
+    uint64_t count;
+    const uint32_t *depth;
+    const uint8_t *type;
+    const uint64_t *size;
+    const uint32_t *mode;
+    const unsigned char *names;
+    size_t names_size;
+    const uint64_t *restart;
+};
+
+// Map and check a snapshot file. Return -1 with errno set on error, EINVAL
+// if the file is not a valid snapshot.
+int snapshot_open(struct snapshot *s, const char *path);
+
+void snapshot_close(struct snapshot *s);
+
+// Sequential decoder of the names, from any restart point.
+struct snapshot_cursor {
+    const struct snapshot *s;
+    uint64_t index; // Of the next name.
+    size_t pos;
+    char *name;     // Current name, terminated.
+    size_t len;
+    size_t capacity;
+};
+
+// Start decoding at the name of entry index, rounded down to a restart point.
+void snapshot_cursor_init(struct snapshot_cursor *c, const struct snapshot *s,
+        uint64_t index);
+
+// Decode the next name. Return NULL at the end, or if the names are corrupted.
+const char* snapshot_cursor_next(struct snapshot_cursor *c);
+
+void snapshot_cursor_free(struct snapshot_cursor *c);
+
+#endif
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#ifdef MYSH_STATS
+
+// Latency buckets, the last one gathers the calls of 2^(HIST_SIZE-2) ns and more.
+#define HIST_SIZE 40
+#define REPORT_SIZE 16384
+
+struct kind_stats {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    // hist[b] counts the calls of [2^(b-1), 2^b) ns, hist[0] the calls of 0 ns.
+    unsigned long long hist[HIST_SIZE];
+};
+
+static const char *KIND_NAMES[STATS_KINDS] = {
+    "getdents", "stat", "open", "read", "write", "chmod", "fork", "wait",
+};
+
+int stats_enabled = 0;
+
+static struct kind_stats STATS_TABLE[STATS_KINDS];
+static const char *PROGRAM;
+static char *REPORT_FILE; // NULL for stderr.
+static pid_t REPORT_PID;
+static long long START_NS;
+
+void stats_end(enum stats_kind kind, long long start, int failed) {
+    int saved_errno = errno;
+    struct kind_stats *s = &STATS_TABLE[kind];
+    unsigned long long ns = stats_begin() - start;
+
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= HIST_SIZE) {
+        bucket = HIST_SIZE - 1;
+    }
+
+    // The commands are threaded, relaxed atomics are enough for counters.
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[bucket], 1, __ATOMIC_RELAXED);
+    if (failed) {
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+    unsigned long long max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && ! __atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    errno = saved_errno;
+}
+
+// Write function of stdout, to account the writes done by stdio.
+static ssize_t stdout_write(void *cookie, const char *buf, size_t size) {
+    (void) cookie;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = STATS(STATS_WRITE, write(STDOUT_FILENO, buf + written, size - written));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return written > 0 ? (ssize_t) written : -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static void report(void) {
+    // Forked children that don't exec (mysh) must not report.
+    if (getpid() != REPORT_PID) {
+        return;
+    }
+    fflush(stdout);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char *buf = malloc(REPORT_SIZE);
+    if (buf == NULL) {
+        return;
+    }
+    int len = snprintf(buf, REPORT_SIZE,
+            "{\"program\":\"%s\",\"pid\":%d,\"wall_ns\":%lld,\"user_us\":%lld,"
+            "\"sys_us\":%lld,\"max_rss_kb\":%ld,\"syscalls\":{",
+            PROGRAM, (int) REPORT_PID, stats_begin() - START_NS,
+            usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec,
+            usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec,
+            usage.ru_maxrss);
+
+    const char *sep = "";
+    for (int k = 0; k < STATS_KINDS && len < REPORT_SIZE; k++) {
+        struct kind_stats *s = &STATS_TABLE[k];
+        if (s->calls == 0) {
+            continue;
+        }
+        len += snprintf(buf + len, REPORT_SIZE - len,
+                "%s\"%s\":{\"calls\":%llu,\"errors\":%llu,\"total_ns\":%llu,"
+                "\"max_ns\":%llu,\"histogram_ns\":{",
+                sep, KIND_NAMES[k], s->calls, s->errors, s->total_ns, s->max_ns);
+        // Keyed by the upper bound of the bucket.
+        const char *hist_sep = "";
+        for (int b = 0; b < HIST_SIZE && len < REPORT_SIZE; b++) {
+            if (s->hist[b] != 0) {
+                len += snprintf(buf + len, REPORT_SIZE - len, "%s\"%llu\":%llu",
+                        hist_sep, 1ULL << b, s->hist[b]);
+                hist_sep = ",";
+            }
+        }
+        if (len < REPORT_SIZE) {
+            len += snprintf(buf + len, REPORT_SIZE - len, "}}");
+        }
+        sep = ",";
+    }
+    if (len < REPORT_SIZE) {
+        len += snprintf(buf + len, REPORT_SIZE - len, "}}\n");
+    }
+    if (len >= REPORT_SIZE) {
+        fprintf(stderr, "%s: stats report truncated\n", PROGRAM);
+        len = REPORT_SIZE - 1;
+        buf[len - 1] = '\n';
+    }
+
+    // A single write, so reports of concurrent commands don't interleave.
+    int fd = STDERR_FILENO;
+    if (REPORT_FILE != NULL) {
+        fd = open(REPORT_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "%s: can't write stats to '%s': %s\n", PROGRAM,
+                    REPORT_FILE, strerror(errno));
+            free(buf);
+            return;
+        }
+    }
+    if (write(fd, buf, len) == -1) {
+        fprintf(stderr, "%s: can't write stats: %s\n", PROGRAM, strerror(errno));
+    }
+    if (fd != STDERR_FILENO) {
+        close(fd);
+    }
+    free(buf);
+}
+
+void stats_init(const char *program) {
+    const char *slash = strrchr(program, '/');
+    PROGRAM = slash != NULL ? slash + 1 : program;
+
+    const char *env = getenv("MYSH_STATS");
+    if (env != NULL && env[0] != '\0') {
+        stats_enable(env);
+    }
+}
+
+void stats_enable(const char *file) {
+    free(REPORT_FILE);
+    REPORT_FILE = file == NULL || strcmp(file, "-") == 0 ? NULL : strdup(file);
+    if (stats_enabled) {
+        return;
+    }
+
+    // Route stdout through stdout_write, keeping its buffering mode.
+    cookie_io_functions_t io = { .write = stdout_write };
+    FILE *out = fopencookie(NULL, "w", io);
+    if (out != NULL) {
+        setvbuf(out, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+        fflush(stdout);
+        stdout = out;
+    }
+
+    REPORT_PID = getpid();
+    START_NS = (stats_enabled = 1, stats_begin());
+    atexit(report);
+}
+
+#else
+
+void stats_init(const char *program) {
+    (void) program;
+}
+
+void stats_enable(const char *file) {
+    (void) file;
+    fprintf(stderr, "warning: built without stats support, --stats ignored\n");
+}
+
+#endif
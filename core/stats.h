@@ -0,0 +1,71 @@
+#ifndef MYSH_STATS_H
+#define MYSH_STATS_H
+
+// Syscall instrumentation of the commands.
+//
+// Wrap a syscall with STATS(kind, call) to count it and record its latency in
+// a log2 histogram. The report is written as one JSON line when the program
+// exits, if --stats was given or the MYSH_STATS environment variable is set
+// (to a file name, or to "-" for stderr).
+//
+// Built with -Dstats=false, STATS(kind, call) is just call.
+
+#include <getopt.h>
+
+enum stats_kind {
+    STATS_GETDENTS,
+    STATS_STAT,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_CHMOD,
+    STATS_FORK,
+    STATS_WAIT, // Of the children, it includes their exec and run time.
+    STATS_KINDS
+};
+
+// getopt_long() value of --stats[=FILE], for the longopts tables.
+#define STATS_OPT 0x100
+#define STATS_LONGOPT {"stats", optional_argument, 0, STATS_OPT}
+
+#ifdef MYSH_STATS
+
+#include <errno.h>
+#include <time.h>
+
+extern int stats_enabled;
+
+// Start of a measure, 0 when the stats are disabled.
+static inline long long stats_begin(void) {
+    if (! stats_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Record a call started at start, errno is preserved.
+void stats_end(enum stats_kind kind, long long start, int failed);
+
+#define STATS(kind, call) ({ \
+    long long stats_start_ = stats_begin(); \
+    __typeof__(call) stats_ret_ = (call); \
+    if (stats_start_ != 0) { \
+        stats_end((kind), stats_start_, stats_ret_ == -1); \
+    } \
+    stats_ret_; })
+
+#else
+
+#define STATS(kind, call) (call)
+
+#endif
+
+// Read MYSH_STATS from the environment. To call at the start of main().
+void stats_init(const char *program);
+
+// Enable the report for --stats, to file or to stderr if file is NULL or "-".
+void stats_enable(const char *file);
+
+#endif
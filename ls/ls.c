@@ -1,33 +1,30 @@
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-#include <sys/syscall.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdbool.h>
 
-#define BUF_SIZE 1024
+#include "dir_iter.h"
+#include "snapshot.h"
+#include "stats.h"
+
 #define EXCLUDE_DIR_SIZE 10
 
 #define PRINT_HEADER printf("%s%20s%5s%5s%10s\n", "Name", "Userid", \
                      "Groupid", "Mode", "Size")
 
-struct linux_dirent {
-    unsigned long  d_ino;     /* Inode number */
-    unsigned long  d_off;     /* Offset to next linux_dirent */
-    unsigned short d_reclen;  /* Length of this linux_dirent */
-    char           d_name[];
-};
-
 struct file_info {
     char *name;
     int userid;
     int groupid;
     int mode;
     long size;
+    unsigned char type;
 };
 
 struct option longopts[] = {
@@ -35,63 +32,72 @@ struct option longopts[] = {
     {"exclude", no_argument, 0, 'e'},
     {"all", no_argument, 0, 'a'},
     {"long", no_argument, 0, 'l'},
+    {"format", required_argument, 0, 'f'},
+    STATS_LONGOPT,
     {0,0,0,0}
 };
 
 int is_directory(int fd) {
     struct stat sb;
-    if (fstat(fd, &sb) == -1) {
+    if (STATS(STATS_STAT, fstat(fd, &sb)) == -1) {
         exit(EXIT_FAILURE);
     }
     return S_ISDIR(sb.st_mode);
 }
 
-struct file_info* get_file_info(int dirfd, struct file_info *info) {
+// Fill the stat fields of an entry, for a link those of the link itself like
+// its type. Return -1 if it can't be read.
+int get_file_info(int dirfd, const char *name, struct file_info *info) {
     struct stat buf;
-    fstatat(dirfd, info->name, &buf, 0);
+    if (STATS(STATS_STAT, fstatat(dirfd, name, &buf, AT_SYMLINK_NOFOLLOW)) == -1) {
+        return -1;
+    }
     info->size = buf.st_size;
     info->groupid = buf.st_gid;
     info->userid = buf.st_uid;
     info->mode = buf.st_mode;
-    return info;
+    return 0;
 }
 
 struct file_info** get_file_list(int fd) {
     struct file_info **infos = malloc(10 * sizeof(struct file_info *));
     int count = 0;
+    struct dir_iter it;
+    struct linux_dirent64 *d;
 
-    while (1) {
-        char buf[BUF_SIZE];
-        int nread = syscall(SYS_getdents, fd, buf, BUF_SIZE);
+    dir_iter_init(&it, fd, 0);
+    while ((d = dir_iter_next(&it)) != NULL) {
+        unsigned char d_type = dir_entry_type(fd, d);
 
-        if (nread == -1) {
-            exit(EXIT_FAILURE);
-        } if (nread == 0) {
-            break;
+        if (((count) % 10) == 0) {
+            infos = realloc(infos, (count + 10) * sizeof(struct file_info *));
         }
-        struct linux_dirent *d;
-        for (int bpos = 0; bpos < nread; bpos += d->d_reclen) {
-            d = (struct linux_dirent *) (buf + bpos);
-            char d_type = *(buf + bpos + d->d_reclen - 1);
 
-            if (((count) % 10) == 0) {
-                infos = realloc(infos, (count + 10) * sizeof(struct file_info *));
+        infos[count] = malloc(sizeof(struct file_info));
+        if (get_file_info(fd, d->d_name, infos[count]) == -1) {
+            // Removed since the listing, otherwise reported.
+            if (errno != ENOENT) {
+                fprintf(stderr, "myls: cannot stat %s: %s\n", d->d_name, strerror(errno));
             }
+            free(infos[count]);
+            continue;
+        }
 
-            infos[count] = malloc(sizeof(struct file_info));
-
-            int str_size = strlen(d->d_name) + 1;
-            if (d_type == DT_DIR) { str_size++; }
-            infos[count]->name = malloc(str_size);
-            strncpy(infos[count]->name, d->d_name, str_size);
+        int str_size = strlen(d->d_name) + 1;
+        if (d_type == DT_DIR) { str_size++; }
+        infos[count]->name = malloc(str_size);
+        strncpy(infos[count]->name, d->d_name, str_size);
 
-            if (d_type == DT_DIR) {
-                infos[count]->name[str_size-2] = '/';
-            }
-            infos[count]->name[str_size-1] = '\0';
-            infos[count] = get_file_info(fd, infos[count]);
-            count++;
+        if (d_type == DT_DIR) {
+            infos[count]->name[str_size-2] = '/';
         }
+        infos[count]->name[str_size-1] = '\0';
+        infos[count]->type = d_type;
+        count++;
+    }
+    dir_iter_free(&it);
+    if (it.error != 0) {
+        exit(EXIT_FAILURE);
     }
     infos = realloc(infos, (count+1) * sizeof(struct file_info *));
     infos[count] = NULL;
@@ -106,8 +112,73 @@ void free_file_list(struct file_info **infos) {
     free(infos);
 }
 
+// Check if a file is listed, with the -a and -e options.
+bool is_listed(struct file_info *info, char *exclude[], int all_f) {
+    // Exclude hidden files or all_f is set
+    if (strncmp(info->name, ".", 1) == 0 && !all_f) {
+        return false;
+    }
+    // Exclude from given formats.
+    for (int j = 0; exclude[j] != NULL; j++) {
+        if (strncmp(info->name, exclude[j], strlen(exclude[j])) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int compare_file_infos(const void *a, const void *b) {
+    return strcmp((*(struct file_info * const *) a)->name,
+                  (*(struct file_info * const *) b)->name);
+}
+
+// Write the listing of a directory as a binary snapshot on stdout: the
+// directory at depth 0 then its sorted entries, without . and .. and without
+// the / of the directories.
+void write_file_snapshot(char *path, char *exclude[], int all_f) {
+    int fd = STATS(STATS_OPEN, open(path, O_RDONLY));
+    struct stat sb;
+    if (fd == -1 || STATS(STATS_STAT, fstat(fd, &sb)) == -1) {
+        fprintf(stderr, "%s is not a valid directory.\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct file_info **file_list = get_file_list(fd);
+    int count = 0;
+    for (int i = 0; file_list[i] != NULL; i++) {
+        struct file_info *info = file_list[i];
+        if (strcmp(info->name, "./") == 0 || strcmp(info->name, "../") == 0 ||
+                ! is_listed(info, exclude, all_f)) {
+            continue;
+        }
+        if (info->type == DT_DIR) {
+            info->name[strlen(info->name) - 1] = '\0';
+        }
+        // Compact the listed entries at the start, the others stay after
+        // the NULL to be freed.
+        file_list[i] = file_list[count];
+        file_list[count++] = info;
+    }
+    qsort(file_list, count, sizeof(struct file_info *), compare_file_infos);
+
+    struct snapshot_writer w;
+    snapshot_writer_init(&w);
+    snapshot_add(&w, path, 0, DT_DIR, sb.st_size, sb.st_mode);
+    for (int i = 0; i < count; i++) {
+        snapshot_add(&w, file_list[i]->name, 1, file_list[i]->type,
+                file_list[i]->size, file_list[i]->mode);
+    }
+    if (snapshot_write(&w, STDOUT_FILENO) == -1) {
+        fprintf(stderr, "can't write the snapshot: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    snapshot_writer_free(&w);
+    free_file_list(file_list);
+    close(fd);
+}
+
 void display_file_display(char *path, char *exclude[], int all_f, int long_f) {
-    int fd = open(path, O_RDONLY);
+    int fd = STATS(STATS_OPEN, open(path, O_RDONLY));
     if (fd == -1) {
         fprintf(stderr, "%s is not a valid directory.\n", path);
         exit(EXIT_FAILURE);
@@ -119,21 +190,8 @@ void display_file_display(char *path, char *exclude[], int all_f, int long_f) {
 
     struct file_info **file_list = get_file_list(fd);
     for (int i = 0; file_list[i] != NULL; i++) {
-        // Exclude hidden files or all_f is set
         struct file_info *info = file_list[i];
-        if (strncmp(info->name, ".", 1) == 0 && !all_f) {
-            continue;
-        }
-        // Exclude from given formats.
-        bool found = false;
-        for (int j = 0; exclude[j] != NULL; j++) {
-            if (strncmp(info->name, exclude[j], strlen(exclude[j])) == 0) {
-                found = true;
-                break;
-            }
-        }
-
-        if (found) { continue; }
+        if (! is_listed(info, exclude, all_f)) { continue; }
 
         if (long_f) {
             printf("%20s%5i%5i%10i%10lu\n", info->name, info->userid,
@@ -151,18 +209,24 @@ void display_file_display(char *path, char *exclude[], int all_f, int long_f) {
 int main (int argc, char *argv[]) {
     int all_f = 0;
     int long_f = 0;
+    int bin_f = 0;
     char *exclude_format[EXCLUDE_DIR_SIZE] = { 0 };
 
+    stats_init(argv[0]);
+
     int c;
-    while ((c = getopt_long(argc, argv, "hae:l", longopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hae:lf:", longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 // Print the help.
-                printf("usage: ls [-e|--exclude FORMAT] [-a|--all] -- [FILE]...\n"
+                printf("usage: ls [-e|--exclude FORMAT] [-a|--all] [-f|--format text|bin]\n"
+                        "          [--stats[=FILE]] -- [FILE]...\n"
                         "  ----- Options -----\n" \
                         "  -e\tExclude file based on the format.\n" \
                         "  -a\tShow hidden files.\n" \
-                        "  -l\tDisplay more informations about the files.\n");
+                        "  -l\tDisplay more informations about the files.\n" \
+                        "  -f\tWrite a binary snapshot of one directory with 'bin', see mytree --diff.\n" \
+                        "  --stats\tReport the syscall counts and latencies as JSON at exit.\n");
                 return EXIT_SUCCESS;
             case 'e':
                 ;
@@ -181,6 +245,17 @@ int main (int argc, char *argv[]) {
             case 'l':
                 long_f = 1;
                 break;
+            case 'f':
+                if (strcmp(optarg, "bin") == 0) {
+                    bin_f = 1;
+                } else if (strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "%s: '%s' is not a valid format.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case STATS_OPT:
+                stats_enable(optarg);
+                break;
             case ':':
                 // Missing option argument
                 fprintf(stderr, "%s: option '-%c' requires an argument.\n", argv[0], optopt);
@@ -192,6 +267,19 @@ int main (int argc, char *argv[]) {
         }
     }
 
+    if (bin_f) {
+        if ((argc - optind) > 1) {
+            fprintf(stderr, "%s: --format=bin takes a single directory.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "%s: not writing a binary snapshot to a terminal.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        write_file_snapshot((argc - optind) == 0 ? "." : argv[optind], exclude_format, all_f);
+        return EXIT_SUCCESS;
+    }
+
     if ((argc - optind) == 0) {
          display_file_display(".", exclude_format, all_f, long_f);
          return EXIT_SUCCESS;
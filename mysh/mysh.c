@@ -7,6 +7,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include "stats.h"
+
 #define BUFFER_SIZE 10
 
 char** get_cmd_array(int fd) {
@@ -14,7 +16,7 @@ char** get_cmd_array(int fd) {
     char *str = calloc(BUFFER_SIZE, sizeof(char));
     size_t len = 0;
     int c = 0;
-    while (read(fd, &c, 1) == 1) {
+    while (STATS(STATS_READ, read(fd, &c, 1)) == 1) {
         if (c == '\n') { break; }
         if ((++len % BUFFER_SIZE) == 0) {
             str = realloc(str, len + BUFFER_SIZE);
@@ -56,7 +58,7 @@ void free_cmd(char **array) {
 int launch_shell(int fd, int int_mode) {
     while (1) {
         if (int_mode == 1) {
-            write(fd, "$ ", 2);
+            STATS(STATS_WRITE, write(fd, "$ ", 2));
         }
 
         // Get command.
@@ -89,7 +91,7 @@ int launch_shell(int fd, int int_mode) {
         }
 
         // Execute command.
-        pid_t pid = fork();
+        pid_t pid = STATS(STATS_FORK, fork());
         if (pid == 0) {
             // In the child.
             if (execvp(cmd[0], cmd) == -1) {
@@ -105,7 +107,7 @@ int launch_shell(int fd, int int_mode) {
             pid_t w;
             int wstatus;
             // Wait until child terminaison.
-            w = waitpid(pid, &wstatus, 0);
+            w = STATS(STATS_WAIT, waitpid(pid, &wstatus, 0));
             if (w == -1) {
                 // Error.
                 free_cmd(cmd);
@@ -119,11 +121,14 @@ int launch_shell(int fd, int int_mode) {
 int main(int argc, char* argv[]) {
     int int_mode = 1; // Interactive mode.
 
+    // No options, the stats are only enabled with MYSH_STATS.
+    stats_init(argv[0]);
+
     if (argc != 1) {
         // Shell is in batch mode.
         int_mode = 0;
         for (int i = 1; i < argc; i++) {
-            int script_fd = open(argv[i], 0);
+            int script_fd = STATS(STATS_OPEN, open(argv[i], 0));
             int status = launch_shell(script_fd, int_mode);
             close(script_fd);
             if (status == EXIT_FAILURE) {
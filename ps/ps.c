@@ -1,24 +1,63 @@
-#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
-#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUF_SIZE 1024
+#include "dir_iter.h"
+#include "stats.h"
+
+#define STAT_BUF_SIZE 4096
+#define ARENA_BLOCK_SIZE 4096
+#define NAME_SIZE 64
+#define NO_ACCESS_FD -2
+// Below this number of processes, the scan is not worth a thread pool.
+#define PARALLEL_MIN_PIDS 2048
+#define SCAN_CHUNK_SIZE 512
+#define MAX_JOBS 8
 #define PROCFS_PATH "/proc"
+#define DIFF_NAME_SIZE 16 // TASK_COMM_LEN, the kernel truncates longer names.
+#define DIFF_VERIFY_PERIOD 1.0
 
-#define FORMAT_ALL "%5i%20s%12s%15s\n"
-#define FORMAT_ALL_HEADER "%5s%20s%12s%15s\n"
+#define FORMAT_ALL "%5i%20s%12s%15s%12s%7.1f\n"
+#define FORMAT_ALL_HEADER "%5s%20s%12s%15s%12s%7s\n"
 #define FORMAT_SHORT "%5i%20s\n"
 #define FORMAT_SHORT_HEADER "%5s%20s\n"
 
-#define PRINT_HEADER_ALL printf(FORMAT_ALL_HEADER, "PID", "NAME", "VMSIZE", "STATE")
+#define FORMAT_TOP "%5i%20s%8s%12s%10s%12s\n"
+#define FORMAT_TOP_HEADER "%5s%20s%8s%12s%10s%12s\n"
+
+#define FORMAT_FOREST "%5i%14s%14s  %*s%s%s\n"
+#define FORMAT_FOREST_HEADER "%5s%14s%14s  %s\n"
+
+#define FORMAT_THREAD "%5i%7i%20s%15s%7.1f\n"
+#define FORMAT_THREAD_HEADER "%5s%7s%20s%15s%7s\n"
+#define FORMAT_FOLD "%5i%20s%9i%9i%7.1f\n"
+#define FORMAT_FOLD_HEADER "%5s%20s%9s%9s%7s\n"
+#define FORMAT_DIFF "%9.3f %-7s%7i%7i  %s%s%s\n"
+#define FORMAT_DIFF_HEADER "%9s %-7s%7s%7s  %s\n"
+
+#define PRINT_HEADER_ALL printf(FORMAT_ALL_HEADER, "PID", "NAME", "VMSIZE", "STATE", \
+                                "RSS", "%CPU")
 #define PRINT_HEADER_SHORT printf(FORMAT_SHORT_HEADER, "PID", "NAME");
+#define PRINT_HEADER_FOREST printf(FORMAT_FOREST_HEADER, "PID", "TREE VMSIZE", \
+                                   "TREE RSS", "NAME")
+#define PRINT_HEADER_THREAD printf(FORMAT_THREAD_HEADER, "PID", "TID", "NAME", \
+                                   "STATE", "%CPU")
+#define PRINT_HEADER_FOLD printf(FORMAT_FOLD_HEADER, "PID", "NAME", "THREADS", \
+                                 "RUNNING", "%CPU")
+#define PRINT_HEADER_TOP printf(FORMAT_TOP_HEADER, "PID", "NAME", "CPU%", \
+                                "RSS", "RSS+/-", "IO/s")
+#define PRINT_HEADER_DIFF printf(FORMAT_DIFF_HEADER, "TIME", "EVENT", "PID", \
+                                 "PPID", "NAME")
 
 #define STREQ(X, Y) strcmp(X, Y) == 0
 
@@ -27,67 +66,214 @@ struct option longopts[] = {
     {"help", no_argument, 0, 'h'},
     {"all", required_argument, 0, 'a'},
     {"pid", required_argument, 0, 'p'},
+    {"interval", required_argument, 0, 'i'},
+    {"count", required_argument, 0, 'n'},
+    {"jobs", required_argument, 0, 'j'},
+    {"sort", required_argument, 0, 's'},
+    {"top", required_argument, 0, 't'},
+    {"name", required_argument, 0, 'N'},
+    {"user", required_argument, 0, 'u'},
+    {"state", required_argument, 0, 'S'},
+    {"forest", no_argument, 0, 'f'},
+    {"threads", no_argument, 0, 'T'},
+    {"fold", no_argument, 0, 'F'},
+    {"procfs", required_argument, 0, 'P'},
+    {"diff", no_argument, 0, 'd'},
+    STATS_LONGOPT,
     {0, 0, 0, 0}
 };
 
-// Directory entry.
-struct linux_dirent {
-    long           d_ino;
-    off_t          d_off;
-    unsigned short d_reclen;
-    char           d_name[];
-};
-
-// Define a process status.
+// Define a process status, decoded from /proc/*PID*/stat.
 struct process {
     int pid;
-    char *name;
-    char *vmsize;
-    char *state;
+    int ppid;
+    char state;
+    int num_threads;
+    unsigned long long utime;     // In clock ticks.
+    unsigned long long stime;     // In clock ticks.
+    unsigned long long starttime; // In clock ticks after boot.
+    unsigned long vmsize;         // In kB.
+    unsigned long rss;            // In kB.
+    float cpu;                    // Average CPU usage since the start, in %.
+    char *name;                   // Stored in the table arena.
 };
 
+// Order of the displayed processes.
+enum sort_key { SORT_NONE, SORT_PID, SORT_VMSIZE, SORT_RSS, SORT_CPU };
+
+// Selection of the processes, applied during the scan.
+struct scan_filter {
+    const char *name;   // Exact command name, NULL for any.
+    const char *states; // Accepted state letters, NULL for any.
+    int has_uid;
+    uid_t uid;          // Owner of the process.
+    int top;            // Keep only the top first processes, 0 for all.
+};
+
+// Block of a string arena.
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    char data[ARENA_BLOCK_SIZE];
+};
+
+// Append only storage for small strings, freed all at once.
+struct string_arena {
+    struct arena_block *head;
+};
+
+// Processes of a scan, stored contiguously.
+struct process_table {
+    struct process *procs;
+    int size;
+    int capacity;
+    struct string_arena names;
+};
+
+// Part of the PIDs scanned by a worker of the pool.
+struct scan_chunk {
+    int *pids;
+    int size;
+    struct process_table result;
+};
+
+// Scan shared by the workers, which take the chunks in turn.
+struct scan_pool {
+    int procfs_fd;
+    struct scan_filter *filter;
+    struct scan_chunk *chunks;
+    int chunks_size;
+    int next_chunk;
+};
+
+// Process followed between the samples of the monitoring mode.
+struct monitored {
+    int pid;               // 0 for an empty slot.
+    int stat_fd;           // Kept open between samples, -1 if reopened each time.
+    int io_fd;             // Same, or NO_ACCESS_FD if it can't be read.
+    unsigned long seen;    // Last sample in which the process was listed.
+    int sampled;           // Set once a previous sample exists.
+    int shown;             // Selected by the filter in the last sample.
+    unsigned long long cpu;
+    unsigned long rss;
+    unsigned long long io_bytes;
+    // Rates over the last interval, -1 before the second sample or without io.
+    double cpu_pct;
+    long rss_delta;
+    double io_rate;
+    struct process proc;
+    char name[NAME_SIZE];
+};
+
+// Open addressing hash map of the monitored processes, indexed by PID.
+struct pid_map {
+    struct monitored *slots;
+    int capacity; // Power of two.
+    int size;
+};
+
+// Size of a memory page in kB.
+unsigned long PAGE_KB;
+// Clock ticks per second and system uptime in ticks, for the CPU usage.
+long CLK_TCK;
+double UPTIME_TICKS;
+enum sort_key SORT_KEY = SORT_NONE;
+
 // ********** Helper function **********
 
-char* trim_leading_space(char *str) {
-    // Removing leading space.
-    while (isblank((unsigned char) *str)) { str++; }
+// Copy a string in the arena.
+char* arena_strndup(struct string_arena *arena, const char *str, size_t len) {
+    if (len >= ARENA_BLOCK_SIZE) {
+        len = ARENA_BLOCK_SIZE - 1;
+    }
+
+    struct arena_block *block = arena->head;
+    if (block == NULL || block->used + len + 1 > ARENA_BLOCK_SIZE) {
+        block = malloc(sizeof(struct arena_block));
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
 
-    char *out = malloc(strlen(str) + 1);
-    memcpy(out, str, strlen(str) + 1);
+    char *out = block->data + block->used;
+    memcpy(out, str, len);
+    out[len] = '\0';
+    block->used += len + 1;
     return out;
 }
 
-// Get a list of the currrent PIDs.
-int* get_pids(int procfs_fd) {
-    char buf[BUF_SIZE];
-    int arr_size = 0;
-    int *pids = malloc(10 * sizeof(int));
-    struct linux_dirent *d;
+// Move all the strings of src at the end of dst, without copying them.
+void arena_merge(struct string_arena *dst, struct string_arena *src) {
+    if (src->head == NULL) { return; }
 
-    while (1) {
-        int nread = syscall(SYS_getdents, procfs_fd, buf, BUF_SIZE);
+    struct arena_block *tail = src->head;
+    while (tail->next != NULL) { tail = tail->next; }
+    tail->next = dst->head;
+    dst->head = src->head;
+    src->head = NULL;
+}
 
-        if (nread == 0) { break; }
-        if (nread == -1) {
-            // Error.
-            exit(EXIT_FAILURE);
-        }
+void free_arena(struct string_arena *arena) {
+    struct arena_block *block = arena->head;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
 
-        for (int bpos = 0; bpos < nread; bpos += d->d_reclen) {
-            d = (struct linux_dirent *) (buf + bpos);
-            char d_type = *(buf + bpos + d->d_reclen -1);
+// Parse an unsigned decimal number and move the cursor after it.
+unsigned long long parse_ull(char **cursor) {
+    char *c = *cursor;
+    unsigned long long value = 0;
 
-            // Exclude not dir and dir that have not a PID as name.
-            if (d_type != DT_DIR || atoi(d->d_name) == 0) {
-                continue;
-            }
+    if (*c == '-') { c++; }
+    for ( ; *c >= '0' && *c <= '9'; c++) {
+        value = value * 10 + (*c - '0');
+    }
+    *cursor = c;
+    return value;
+}
 
-            if ((++arr_size % 10) == 0) {
-                pids = realloc(pids, (arr_size + 10) * sizeof(int));
-            }
-            pids[arr_size - 1] = atoi(d->d_name);
+// Skip the current field and the space following it.
+void skip_field(char **cursor) {
+    char *c = *cursor;
+    while (*c != ' ' && *c != '\0') { c++; }
+    if (*c == ' ') { c++; }
+    *cursor = c;
+}
+
+// Get the next PID (or TID) of a procfs directory, 0 at the end, or on error
+// when the process exited while we were listing it.
+int next_pid(struct dir_iter *it) {
+    struct linux_dirent64 *d;
+    while ((d = dir_iter_next(it)) != NULL) {
+        // Exclude not dir and dir that have not a PID as name. The type is
+        // stat'ed on filesystems without d_type, like some fake procfs.
+        int pid = atoi(d->d_name);
+        if (pid != 0 && dir_entry_type(it->fd, d) == DT_DIR) {
+            return pid;
         }
     }
+    return 0;
+}
+
+// Get a list of the currrent PIDs.
+int* get_pids(int procfs_fd) {
+    struct dir_iter it;
+    int arr_size = 0;
+    int *pids = malloc(10 * sizeof(int));
+
+    dir_iter_init(&it, procfs_fd, DIR_ITER_REWIND);
+    int pid;
+    while ((pid = next_pid(&it)) != 0) {
+        if ((++arr_size % 10) == 0) {
+            pids = realloc(pids, (arr_size + 10) * sizeof(int));
+        }
+        pids[arr_size - 1] = pid;
+    }
+    dir_iter_free(&it);
     // Terminate the array with a 0 value.
     pids = realloc(pids, (arr_size + 1) * sizeof(int));
     pids[arr_size] = 0;
@@ -97,143 +283,1093 @@ int* get_pids(int procfs_fd) {
 
 // ********** PID status functions **********
 
-// Populate the struct process.
-void process_status_line(struct process *proc, char *line) {
-    // Cut the line into key/value.
-    char *key, *value;
-    key = strtok(line, ":");
-    value = strtok(NULL, ":");
-
-    // Remove useless whitespace in the value.
-    char* new = trim_leading_space(value);
-    value = new;
-
-    // Populate the struct.
-    if (STREQ("Name", key)) {
-        proc->name = value;
-    } else if (STREQ("VmSize", key)) {
-        proc->vmsize = value;
-    } else if (STREQ("State", key)) {
-        proc->state = value;
-    } else {
-        // Free if we don't use the value.
-        free(value);
-    }
-}
-
-// Read the /proc/*PID*/status and parse it.
-struct process* read_pid_status(int pid) {
-    char path[100];
-    snprintf(path, 100, "/proc/%i/status", pid);
-    int fd = open(path, O_RDONLY);
-
-    char buf[BUF_SIZE];
-    int nread;
-
-    char line[BUF_SIZE];
-    int line_size = 0;
-    struct process *proc = calloc(1, sizeof(struct process));
-    while ((nread = read(fd, buf, BUF_SIZE)) > 0) {
-        for (int i = 0; i < nread; i++) {
-            // EOF.
-            if (buf[i] == '\0' || i == BUF_SIZE) { break; }
-            // New line.
-            if (buf[i] == '\n') {
-                line[line_size] = '\0';
-                process_status_line(proc, line);
-
-                line_size = 0;
-            } else {
-                line[line_size] = buf[i];
-                line_size++;
-            }
-        }
+// Decode a /proc/*PID*/stat line, see proc(5) for the fields. The name
+// points inside buf and is not terminated, name_len gives its size.
+int parse_pid_stat(char *buf, struct process *proc, char **name, int *name_len) {
+    // The name is between parentheses and may contain spaces or parentheses.
+    char *open = strchr(buf, '(');
+    char *close = strrchr(buf, ')');
+    if (open == NULL || close == NULL || close < open || close[1] != ' ') {
+        return -1;
     }
-    proc->pid = pid;
+    *name = open + 1;
+    *name_len = close - open - 1;
+
+    char *c = buf;
+    proc->pid = parse_ull(&c);
+
+    // Field 3 (state) and onwards.
+    c = close + 2;
+    proc->state = *c;
+    skip_field(&c);
+    proc->ppid = parse_ull(&c);
+    c++;
+    for (int field = 5; field < 14; field++) { skip_field(&c); }
+    proc->utime = parse_ull(&c);
+    c++;
+    proc->stime = parse_ull(&c);
+    c++;
+    for (int field = 16; field < 20; field++) { skip_field(&c); }
+    proc->num_threads = parse_ull(&c);
+    c++;
+    skip_field(&c);
+    proc->starttime = parse_ull(&c);
+    c++;
+    proc->vmsize = parse_ull(&c) / 1024;
+    c++;
+    proc->rss = parse_ull(&c) * PAGE_KB;
+
+    return 0;
+}
 
-    if (proc->vmsize == NULL) {
-        proc->vmsize = malloc(3);
-        strcpy(proc->vmsize, "-1");
+// Read the /proc/*PID*/stat with a single pread in buf, which must hold
+// STAT_BUF_SIZE bytes, and decode it in proc. The name is left in buf.
+// Return -1 if the process does not exist (anymore).
+int read_pid_stat(int procfs_fd, int pid, char *buf, struct process *proc,
+        char **name, int *name_len) {
+    char path[32];
+    snprintf(path, 32, "%i/stat", pid);
+    int fd = STATS(STATS_OPEN, openat(procfs_fd, path, O_RDONLY));
+    if (fd == -1) {
+        return -1;
     }
 
+    int nread = STATS(STATS_READ, pread(fd, buf, STAT_BUF_SIZE - 1, 0));
     close(fd);
-    return proc;
+    if (nread <= 0) {
+        return -1;
+    }
+    buf[nread] = '\0';
+
+    if (parse_pid_stat(buf, proc, name, name_len) == -1) {
+        return -1;
+    }
+
+    // Average usage over the lifetime of the process, like ps(1).
+    proc->cpu = 0;
+    if (UPTIME_TICKS > proc->starttime) {
+        proc->cpu = 100.0 * (proc->utime + proc->stime) / (UPTIME_TICKS - proc->starttime);
+    }
+    return 0;
 }
 
-struct process** get_processes_status() {
-    // Get PIDs.
-    int procfd = open(PROCFS_PATH, O_RDONLY);
-    int *pids = get_pids(procfd);
-    close(procfd);
+// Read the system uptime, in clock ticks.
+void read_uptime(int procfs_fd) {
+    char buf[64];
+    UPTIME_TICKS = 0;
+
+    int fd = STATS(STATS_OPEN, openat(procfs_fd, "uptime", O_RDONLY));
+    if (fd == -1) { return; }
+    int nread = STATS(STATS_READ, pread(fd, buf, 63, 0));
+    close(fd);
+    if (nread > 0) {
+        buf[nread] = '\0';
+        UPTIME_TICKS = strtod(buf, NULL) * CLK_TCK;
+    }
+}
 
-    // Populate the array of processus status.
-    struct process **procs = malloc(sizeof(struct process) * 10);
-    int procs_size = 0;
-    for (; pids[procs_size] != 0; procs_size++) {
-        if (((procs_size + 1) % 10) == 0) {
-            procs = realloc(procs, sizeof(struct process) * (procs_size + 10));
+// Check if a process is selected by the filter.
+int match_filter(int procfs_fd, struct process *proc, const char *name, int name_len,
+        struct scan_filter *filter) {
+    if (filter->name != NULL &&
+            (strncmp(filter->name, name, name_len) != 0 || filter->name[name_len] != '\0')) {
+        return 0;
+    }
+    if (filter->states != NULL && strchr(filter->states, proc->state) == NULL) {
+        return 0;
+    }
+    if (filter->has_uid) {
+        // The owner of /proc/*PID*/ is the owner of the process.
+        char path[16];
+        struct stat sb;
+        snprintf(path, 16, "%i", proc->pid);
+        if (STATS(STATS_STAT, fstatat(procfs_fd, path, &sb, 0)) == -1 || sb.st_uid != filter->uid) {
+            return 0;
         }
-        procs[procs_size] = read_pid_status(pids[procs_size]);
     }
-    free(pids);
+    return 1;
+}
+
+// Check if a process is displayed before another one.
+int proc_before(struct process *a, struct process *b) {
+    switch (SORT_KEY) {
+        case SORT_VMSIZE:
+            if (a->vmsize != b->vmsize) { return a->vmsize > b->vmsize; }
+            break;
+        case SORT_RSS:
+            if (a->rss != b->rss) { return a->rss > b->rss; }
+            break;
+        case SORT_CPU:
+            if (a->cpu != b->cpu) { return a->cpu > b->cpu; }
+            break;
+        default:
+            break;
+    }
+    return a->pid < b->pid;
+}
+
+int compare_procs(const void *a, const void *b) {
+    return proc_before((struct process *) a, (struct process *) b) ? -1 : 1;
+}
 
-    // Add a NULL at the end of the array.
-    procs = realloc(procs, sizeof(struct process *) * (procs_size + 1));
-    procs[procs_size] = NULL;
+void swap_procs(struct process *a, struct process *b) {
+    struct process tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
 
-    return procs;
+// The top processes are kept in a heap where the root is the process
+// displayed last, the first one to be replaced.
+void heap_sift_up(struct process *heap, int i) {
+    while (i > 0 && proc_before(&heap[(i - 1) / 2], &heap[i])) {
+        swap_procs(&heap[(i - 1) / 2], &heap[i]);
+        i = (i - 1) / 2;
+    }
 }
 
-int is_pid_valid(struct process **procs, int pid) {
-    for (int i = 0; procs[i] != NULL; i++) {
-        if (procs[i]->pid == pid) { return 1; }
+void heap_sift_down(struct process *heap, int size, int i) {
+    while (1) {
+        int last = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++) {
+            if (proc_before(&heap[last], &heap[child])) { last = child; }
+        }
+        if (last == i) { break; }
+        swap_procs(&heap[last], &heap[i]);
+        i = last;
     }
-    return 0;
 }
 
-void free_processes(struct process **procs) {
-    for (int i = 0; procs[i] != NULL; i++) {
-        free(procs[i]->name);
-        if (procs[i]->vmsize != NULL) {
-            free(procs[i]->vmsize);
+// Decide if the process just pushed at the end of the table is kept, in which
+// case its name is stored. With a top, the table is a bounded heap and only
+// the processes better than its root get in.
+void admit_process(struct process_table *table, struct scan_filter *filter,
+        const char *name, int name_len) {
+    struct process *heap = table->procs;
+    int last = table->size - 1;
+
+    if (filter->top > 0 && last == filter->top && ! proc_before(&heap[last], &heap[0])) {
+        table->size--;
+        return;
+    }
+    heap[last].name = arena_strndup(&table->names, name, name_len);
+
+    if (filter->top == 0) { return; }
+    if (last < filter->top) {
+        heap_sift_up(heap, last);
+    } else {
+        // Replace the root.
+        heap[0] = heap[last];
+        table->size--;
+        heap_sift_down(heap, table->size, 0);
+    }
+}
+
+// Get a new slot at the end of the table.
+struct process* process_table_push(struct process_table *table) {
+    if (table->size == table->capacity) {
+        table->capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        table->procs = realloc(table->procs, table->capacity * sizeof(struct process));
+    }
+    return &table->procs[table->size++];
+}
+
+// Read the status of the given PIDs without scanning the whole procfs, and
+// keep the ones selected by the filter. A PID that can't be found is reported
+// when report_missing is set and left out of the table.
+// Return the number of PIDs not found.
+int get_processes_by_pid(struct process_table *table, int procfs_fd, int *pids,
+        int pids_size, struct scan_filter *filter, int report_missing) {
+    char buf[STAT_BUF_SIZE];
+    int missing = 0;
+
+    for (int i = 0; i < pids_size; i++) {
+        struct process *proc = process_table_push(table);
+        char *name;
+        int name_len;
+        if (read_pid_stat(procfs_fd, pids[i], buf, proc, &name, &name_len) == -1) {
+            // The process exited or never existed.
+            table->size--;
+            missing++;
+            if (report_missing) {
+                fprintf(stderr, "Unable to find %i PID\n", pids[i]);
+            }
+            continue;
         }
-        free(procs[i]->state);
-        free(procs[i]);
+
+        if (! match_filter(procfs_fd, proc, name, name_len, filter)) {
+            table->size--;
+            continue;
+        }
+        admit_process(table, filter, name, name_len);
+    }
+    return missing;
+}
+
+// Put the table in display order.
+void sort_processes(struct process_table *table, struct scan_filter *filter) {
+    if (SORT_KEY == SORT_NONE && filter->top == 0) { return; }
+
+    qsort(table->procs, table->size, sizeof(struct process), compare_procs);
+    if (filter->top > 0 && table->size > filter->top) {
+        table->size = filter->top;
     }
-    free(procs);
+}
+
+int compare_pids(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// Worker of the scan pool, each one with its own buffer.
+void* scan_worker(void *arg) {
+    struct scan_pool *pool = arg;
+
+    while (1) {
+        int i = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED);
+        if (i >= pool->chunks_size) { break; }
+
+        struct scan_chunk *chunk = &pool->chunks[i];
+        get_processes_by_pid(&chunk->result, pool->procfs_fd, chunk->pids,
+                chunk->size, pool->filter, 0);
+    }
+    return NULL;
+}
+
+// Scan the PIDs by chunks on jobs threads, then merge the chunks in order.
+void get_processes_parallel(struct process_table *table, int procfs_fd, int *pids,
+        int pids_size, struct scan_filter *filter, int jobs) {
+    struct scan_pool pool = { .procfs_fd = procfs_fd, .filter = filter, .next_chunk = 0 };
+    pool.chunks_size = (pids_size + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE;
+    pool.chunks = calloc(pool.chunks_size, sizeof(struct scan_chunk));
+    for (int i = 0; i < pool.chunks_size; i++) {
+        pool.chunks[i].pids = pids + i * SCAN_CHUNK_SIZE;
+        pool.chunks[i].size = pids_size - i * SCAN_CHUNK_SIZE;
+        if (pool.chunks[i].size > SCAN_CHUNK_SIZE) {
+            pool.chunks[i].size = SCAN_CHUNK_SIZE;
+        }
+    }
+
+    // The calling thread is one of the workers.
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    for ( ; started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, scan_worker, &pool) != 0) {
+            break;
+        }
+    }
+    scan_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int total = table->size;
+    for (int i = 0; i < pool.chunks_size; i++) {
+        total += pool.chunks[i].result.size;
+    }
+    if (total > table->capacity) {
+        table->capacity = total;
+        table->procs = realloc(table->procs, table->capacity * sizeof(struct process));
+    }
+    for (int i = 0; i < pool.chunks_size; i++) {
+        struct process_table *result = &pool.chunks[i].result;
+        memcpy(table->procs + table->size, result->procs,
+                result->size * sizeof(struct process));
+        table->size += result->size;
+        arena_merge(&table->names, &result->names);
+        free(result->procs);
+    }
+    free(pool.chunks);
+}
+
+// Scan every process selected by the filter, in display order. Large process
+// tables are split on a pool of jobs threads, each chunk keeping its own top.
+void get_processes_status(struct process_table *table, int procfs_fd,
+        struct scan_filter *filter, int jobs) {
+    int *pids = get_pids(procfs_fd);
+    int pids_size = 0;
+    for ( ; pids[pids_size] != 0; pids_size++);
+    qsort(pids, pids_size, sizeof(int), compare_pids);
+
+    if (jobs > 1 && pids_size >= PARALLEL_MIN_PIDS) {
+        get_processes_parallel(table, procfs_fd, pids, pids_size, filter, jobs);
+    } else {
+        get_processes_by_pid(table, procfs_fd, pids, pids_size, filter, 0);
+    }
+    free(pids);
+    sort_processes(table, filter);
+}
+
+void free_process_table(struct process_table *table) {
+    free(table->procs);
+    free_arena(&table->names);
 }
 
 // ********** Display functions **********
 
+// Describe a state like /proc/*PID*/status does.
+const char* state_description(char state) {
+    switch (state) {
+        case 'R': return "R (running)";
+        case 'S': return "S (sleeping)";
+        case 'D': return "D (disk sleep)";
+        case 'T': return "T (stopped)";
+        case 't': return "t (tracing stop)";
+        case 'X': return "X (dead)";
+        case 'Z': return "Z (zombie)";
+        case 'P': return "P (parked)";
+        case 'I': return "I (idle)";
+        default: return "?";
+    }
+}
+
 void display_proc_all(struct process *p) {
-    printf(FORMAT_ALL, p->pid, p->name, p->vmsize, p->state);
+    char vmsize[32] = "-1";
+    char rss[32];
+    // Kernel threads don't have a virtual memory.
+    if (p->vmsize != 0) {
+        snprintf(vmsize, 32, "%lu kB", p->vmsize);
+    }
+    snprintf(rss, 32, "%lu kB", p->rss);
+    printf(FORMAT_ALL, p->pid, p->name, vmsize, state_description(p->state), rss, p->cpu);
 }
 
 void display_proc_short(struct process *p) {
     printf(FORMAT_SHORT, p->pid, p->name);
 }
 
-int display_procs(struct process **procs, int all_f, int pid) {
-    if (pid != 0 && ! is_pid_valid(procs, pid)) {
-        fprintf(stderr, "Unable to find %i PID\n", pid);
-        return EXIT_FAILURE;
-    }
-
+void display_procs(struct process_table *table, int all_f) {
     if (all_f) {
         PRINT_HEADER_ALL;
     } else {
         PRINT_HEADER_SHORT;
     }
 
-    for (int i = 0; procs[i] != NULL; i++) {
-        if (all_f && (pid == 0 || procs[i]->pid == pid)) {
-            display_proc_all(procs[i]);
-        } else if (! all_f && (pid == 0 || procs[i]->pid == pid)) {
-            display_proc_short(procs[i]);
+    for (int i = 0; i < table->size; i++) {
+        if (all_f) {
+            display_proc_all(&table->procs[i]);
+        } else {
+            display_proc_short(&table->procs[i]);
         }
     }
+}
 
-    return EXIT_SUCCESS;
+// ********** Thread functions **********
+
+// Per-process totals of the threads.
+struct thread_totals {
+    int threads;
+    int running;
+    float cpu;
+};
+
+void display_thread(int pid, struct process *t, const char *name) {
+    printf(FORMAT_THREAD, pid, t->pid, name, state_description(t->state), t->cpu);
+}
+
+void display_thread_totals(struct process *p, struct thread_totals *totals) {
+    printf(FORMAT_FOLD, p->pid, p->name, totals->threads, totals->running, totals->cpu);
+}
+
+// Scan the threads of a process in /proc/*PID*/task/. Each thread is displayed,
+// or folded in the process totals, as soon as it is read: nothing is stored
+// per thread. Return -1 if the process exited.
+int scan_threads(int procfs_fd, int pid, struct scan_filter *filter, int fold_f,
+        struct dir_iter *it, char *buf) {
+    char path[32];
+    snprintf(path, 32, "%i/task", pid);
+    int task_fd = STATS(STATS_OPEN, openat(procfs_fd, path, O_RDONLY | O_DIRECTORY));
+    if (task_fd == -1) {
+        return -1;
+    }
+
+    // The process itself, for the name and the totals.
+    struct process proc;
+    char proc_name[NAME_SIZE];
+    char *name;
+    int name_len;
+    if (read_pid_stat(procfs_fd, pid, buf, &proc, &name, &name_len) == -1) {
+        close(task_fd);
+        return -1;
+    }
+    if (name_len >= NAME_SIZE) { name_len = NAME_SIZE - 1; }
+    memcpy(proc_name, name, name_len);
+    proc_name[name_len] = '\0';
+    proc.name = proc_name;
+
+    struct thread_totals totals = { 0 };
+    dir_iter_reset(it, task_fd, 0);
+    int tid;
+    while ((tid = next_pid(it)) != 0) {
+        struct process thread;
+        if (read_pid_stat(task_fd, tid, buf, &thread, &name, &name_len) == -1) {
+            // The thread exited.
+            continue;
+        }
+        if (! match_filter(task_fd, &thread, name, name_len, filter)) {
+            continue;
+        }
+
+        if (fold_f) {
+            totals.threads++;
+            totals.running += thread.state == 'R';
+            totals.cpu += thread.cpu;
+        } else {
+            name[name_len] = '\0';
+            display_thread(pid, &thread, name);
+        }
+    }
+    close(task_fd);
+
+    if (fold_f && totals.threads > 0) {
+        display_thread_totals(&proc, &totals);
+    }
+    return 0;
+}
+
+// Display the threads of the given PIDs, or of every process. Return the
+// number of PIDs not found.
+int display_threads(int procfs_fd, int *pids, struct scan_filter *filter, int fold_f) {
+    // Shared by all the processes, the task directories are listed one at a time.
+    struct dir_iter task_it = { .buf = NULL };
+    char buf[STAT_BUF_SIZE];
+    int missing = 0;
+
+    if (fold_f) {
+        PRINT_HEADER_FOLD;
+    } else {
+        PRINT_HEADER_THREAD;
+    }
+
+    if (pids != NULL) {
+        for (int i = 0; pids[i] != 0; i++) {
+            if (scan_threads(procfs_fd, pids[i], filter, fold_f, &task_it, buf) == -1) {
+                fprintf(stderr, "Unable to find %i PID\n", pids[i]);
+                missing++;
+            }
+        }
+    } else {
+        struct dir_iter proc_it;
+        dir_iter_init(&proc_it, procfs_fd, DIR_ITER_REWIND);
+        int pid;
+        while ((pid = next_pid(&proc_it)) != 0) {
+            scan_threads(procfs_fd, pid, filter, fold_f, &task_it, buf);
+        }
+        dir_iter_free(&proc_it);
+    }
+    dir_iter_free(&task_it);
+    return missing;
+}
+
+// ********** Monitoring functions **********
+
+unsigned int pid_hash(int pid, int capacity) {
+    return ((unsigned int) pid * 2654435761u) & (capacity - 1);
+}
+
+// Find the slot of pid, or the empty slot where it should be inserted.
+struct monitored* pid_map_slot(struct pid_map *map, int pid) {
+    unsigned int i = pid_hash(pid, map->capacity);
+    while (map->slots[i].pid != 0 && map->slots[i].pid != pid) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return &map->slots[i];
+}
+
+void pid_map_grow(struct pid_map *map) {
+    struct monitored *old = map->slots;
+    int old_capacity = map->capacity;
+
+    map->capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+    map->slots = calloc(map->capacity, sizeof(struct monitored));
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].pid != 0) {
+            *pid_map_slot(map, old[i].pid) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Get the entry of pid, inserting an empty one if needed.
+struct monitored* pid_map_get(struct pid_map *map, int pid, int *inserted) {
+    // Keep the load factor under 1/2.
+    if ((map->size + 1) * 2 > map->capacity) {
+        pid_map_grow(map);
+    }
+
+    struct monitored *m = pid_map_slot(map, pid);
+    *inserted = m->pid == 0;
+    if (*inserted) {
+        memset(m, 0, sizeof(struct monitored));
+        m->pid = pid;
+        map->size++;
+    }
+    return m;
+}
+
+// Remove an entry, shifting back the following ones of the cluster.
+void pid_map_remove(struct pid_map *map, struct monitored *m) {
+    unsigned int mask = map->capacity - 1;
+    unsigned int hole = m - map->slots;
+    unsigned int i = hole;
+
+    if (m->stat_fd >= 0) { close(m->stat_fd); }
+    if (m->io_fd >= 0) { close(m->io_fd); }
+    m->pid = 0;
+    map->size--;
+
+    while (1) {
+        i = (i + 1) & mask;
+        if (map->slots[i].pid == 0) { break; }
+
+        // Move the entry in the hole if its home is not between them.
+        unsigned int home = pid_hash(map->slots[i].pid, map->capacity);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->slots[hole] = map->slots[i];
+            map->slots[i].pid = 0;
+            hole = i;
+        }
+    }
+}
+
+// Open a file of /proc/*PID*/, or return -1.
+int open_pid_file(int procfs_fd, int pid, const char *file) {
+    char path[32];
+    snprintf(path, 32, "%i/%s", pid, file);
+    return STATS(STATS_OPEN, openat(procfs_fd, path, O_RDONLY));
+}
+
+// Read a file of /proc/*PID*/ with a single pread. A fd of -1 means the file
+// is opened for this read only.
+int pread_pid_file(int procfs_fd, int pid, int fd, const char *file, char *buf) {
+    int own_fd = fd == -1;
+    if (own_fd) {
+        fd = open_pid_file(procfs_fd, pid, file);
+        if (fd == -1) { return -1; }
+    }
+
+    int nread = STATS(STATS_READ, pread(fd, buf, STAT_BUF_SIZE - 1, 0));
+    if (own_fd) { close(fd); }
+    if (nread <= 0) {
+        return -1;
+    }
+    buf[nread] = '\0';
+    return nread;
+}
+
+// Decode the bytes really read and written from a /proc/*PID*/io file.
+unsigned long long parse_pid_io(char *buf) {
+    unsigned long long total = 0;
+    const char *keys[] = { "\nread_bytes: ", "\nwrite_bytes: " };
+
+    for (int i = 0; i < 2; i++) {
+        char *c = strstr(buf, keys[i]);
+        if (c != NULL) {
+            c += strlen(keys[i]);
+            total += parse_ull(&c);
+        }
+    }
+    return total;
+}
+
+// Take a new sample of a monitored process, and check if it is selected by
+// the filter. Return -1 if the process exited.
+int sample_monitored(struct monitored *m, int procfs_fd, char *buf, double elapsed,
+        struct scan_filter *filter) {
+    if (pread_pid_file(procfs_fd, m->pid, m->stat_fd, "stat", buf) == -1) {
+        return -1;
+    }
+
+    char *name;
+    int name_len;
+    if (parse_pid_stat(buf, &m->proc, &name, &name_len) == -1) {
+        return -1;
+    }
+    m->shown = match_filter(procfs_fd, &m->proc, name, name_len, filter);
+    if (name_len >= NAME_SIZE) { name_len = NAME_SIZE - 1; }
+    memcpy(m->name, name, name_len);
+    m->name[name_len] = '\0';
+
+    unsigned long long cpu = m->proc.utime + m->proc.stime;
+    unsigned long long io_bytes = 0;
+    int has_io = m->io_fd != NO_ACCESS_FD &&
+        pread_pid_file(procfs_fd, m->pid, m->io_fd, "io", buf) != -1;
+    if (has_io) {
+        io_bytes = parse_pid_io(buf);
+    }
+
+    m->cpu_pct = -1;
+    m->rss_delta = 0;
+    m->io_rate = -1;
+    if (m->sampled && elapsed > 0) {
+        m->cpu_pct = 100.0 * (cpu - m->cpu) / (CLK_TCK * elapsed);
+        m->rss_delta = (long) (m->proc.rss - m->rss);
+        if (has_io) {
+            m->io_rate = (io_bytes - m->io_bytes) / 1024.0 / elapsed;
+        }
+    }
+    m->cpu = cpu;
+    m->rss = m->proc.rss;
+    m->io_bytes = io_bytes;
+    m->sampled = 1;
+    return 0;
+}
+
+void display_monitored(struct monitored *m) {
+    char cpu_str[16] = "-";
+    char rss_str[32];
+    char rss_delta_str[32] = "-";
+    char io_str[32] = "-";
+    snprintf(rss_str, 32, "%lu kB", m->proc.rss);
+    if (m->cpu_pct >= 0) {
+        snprintf(cpu_str, 16, "%.1f", m->cpu_pct);
+        snprintf(rss_delta_str, 32, "%+ld", m->rss_delta);
+    }
+    if (m->io_rate >= 0) {
+        snprintf(io_str, 32, "%.0f kB", m->io_rate);
+    }
+    printf(FORMAT_TOP, m->pid, m->name, cpu_str, rss_str, rss_delta_str, io_str);
+}
+
+// Like proc_before(), the CPU being the usage over the last interval.
+int compare_monitored(const void *a, const void *b) {
+    const struct monitored *x = *(struct monitored * const *) a;
+    const struct monitored *y = *(struct monitored * const *) b;
+    switch (SORT_KEY) {
+        case SORT_VMSIZE:
+            if (x->proc.vmsize != y->proc.vmsize) { return x->proc.vmsize > y->proc.vmsize ? -1 : 1; }
+            break;
+        case SORT_RSS:
+            if (x->proc.rss != y->proc.rss) { return x->proc.rss > y->proc.rss ? -1 : 1; }
+            break;
+        case SORT_CPU:
+            if (x->cpu_pct != y->cpu_pct) { return x->cpu_pct > y->cpu_pct ? -1 : 1; }
+            break;
+        default:
+            break;
+    }
+    return x->pid < y->pid ? -1 : 1;
+}
+
+// Display the processes of a sample sorted, and only the top first ones.
+void display_monitored_sorted(struct pid_map *map, unsigned long sample, int top) {
+    struct monitored **rows = malloc(map->size * sizeof(struct monitored *));
+    int size = 0;
+    for (int i = 0; i < map->capacity; i++) {
+        struct monitored *m = &map->slots[i];
+        if (m->pid != 0 && m->seen == sample && m->shown) {
+            rows[size++] = m;
+        }
+    }
+    qsort(rows, size, sizeof(struct monitored *), compare_monitored);
+    if (top > 0 && size > top) { size = top; }
+    for (int i = 0; i < size; i++) {
+        display_monitored(rows[i]);
+    }
+    free(rows);
+}
+
+double timespec_diff(struct timespec *a, struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+// Move the deadline next by interval seconds and sleep until it, so the
+// samples don't drift.
+void sleep_until_next(struct timespec *next, double interval) {
+    next->tv_sec += (time_t) interval;
+    next->tv_nsec += (long) ((interval - (time_t) interval) * 1e9);
+    if (next->tv_nsec >= 1000000000) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+// Display the processes every interval seconds, count times (forever if 0).
+// The /proc/*PID*/ files stay open between samples, so only the processes
+// that appeared or exited cost more than a pread. Unsorted, each process is
+// displayed as soon as it is sampled.
+void monitor_processes(int procfs_fd, int *pids, double interval, int count,
+        struct scan_filter *filter) {
+    char buf[STAT_BUF_SIZE];
+    struct pid_map map = { 0 };
+    int clear = isatty(STDOUT_FILENO);
+    int sorted = SORT_KEY != SORT_NONE || filter->top > 0;
+
+    // Keeping files open needs more than the default soft limit.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct timespec next, now, last;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    last = next;
+
+    for (unsigned long sample = 1; count == 0 || sample <= (unsigned long) count; sample++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = timespec_diff(&now, &last);
+        last = now;
+
+        if (clear) {
+            printf("\033[H\033[2J");
+        } else if (sample > 1) {
+            printf("\n");
+        }
+        PRINT_HEADER_TOP;
+
+        // List the processes, unless only some PIDs are followed.
+        int *listed = pids != NULL ? pids : get_pids(procfs_fd);
+        int seen = 0;
+        for (int i = 0; listed[i] != 0; i++) {
+            int inserted;
+            struct monitored *m = pid_map_get(&map, listed[i], &inserted);
+            if (inserted) {
+                // New process. If the fds can't be kept, they are reopened
+                // at each sample.
+                m->stat_fd = open_pid_file(procfs_fd, m->pid, "stat");
+                m->io_fd = open_pid_file(procfs_fd, m->pid, "io");
+                if (m->io_fd == -1 && errno != EMFILE) {
+                    // Only readable for our own processes.
+                    m->io_fd = NO_ACCESS_FD;
+                }
+            }
+
+            if (sample_monitored(m, procfs_fd, buf, elapsed, filter) == -1) {
+                pid_map_remove(&map, m);
+                continue;
+            }
+            m->seen = sample;
+            seen++;
+            if (! sorted && m->shown) {
+                display_monitored(m);
+            }
+        }
+        if (listed != pids) { free(listed); }
+
+        // Forget the processes that exited since the last sample.
+        for (int i = 0; seen != map.size && i < map.capacity; i++) {
+            if (map.slots[i].pid != 0 && map.slots[i].seen != sample) {
+                pid_map_remove(&map, &map.slots[i]);
+                // The next entry may have been shifted in this slot.
+                i--;
+            }
+        }
+        if (sorted) {
+            display_monitored_sorted(&map, sample, filter->top);
+        }
+        fflush(stdout);
+
+        if (count != 0 && sample == (unsigned long) count) { break; }
+
+        sleep_until_next(&next, interval);
+    }
+
+    for (int i = 0; i < map.capacity; i++) {
+        if (map.slots[i].pid != 0) {
+            if (map.slots[i].stat_fd >= 0) { close(map.slots[i].stat_fd); }
+            if (map.slots[i].io_fd >= 0) { close(map.slots[i].io_fd); }
+        }
+    }
+    free(map.slots);
+}
+
+// ********** Diff functions **********
+
+// Process known by --diff. The starttime tells a process apart from a newer
+// one reusing its PID.
+struct diff_entry {
+    int pid;
+    int ppid;
+    unsigned long long starttime;
+    int selected; // Matched the filter when last read.
+    char name[DIFF_NAME_SIZE];
+};
+
+// Processes of a sample, sorted by PID.
+struct diff_table {
+    struct diff_entry *entries;
+    int size;
+    int capacity;
+};
+
+struct diff_entry* diff_table_push(struct diff_table *table) {
+    if (table->size == table->capacity) {
+        table->capacity = table->capacity == 0 ? 256 : table->capacity * 2;
+        table->entries = realloc(table->entries, table->capacity * sizeof(struct diff_entry));
+    }
+    return &table->entries[table->size++];
+}
+
+// List the PIDs of procfs in pids, sorted, with one getdents pass (usually a
+// single syscall with the iterator buffer). Return their number.
+int list_sorted_pids(struct dir_iter *it, int procfs_fd, int **pids, int *capacity) {
+    int size = 0;
+    int sorted = 1;
+    int pid;
+
+    dir_iter_reset(it, procfs_fd, DIR_ITER_REWIND);
+    while ((pid = next_pid(it)) != 0) {
+        if (size == *capacity) {
+            *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+            *pids = realloc(*pids, *capacity * sizeof(int));
+        }
+        if (size > 0 && (*pids)[size - 1] > pid) { sorted = 0; }
+        (*pids)[size++] = pid;
+    }
+    // The kernel lists the PIDs in order, other roots may not.
+    if (! sorted) {
+        qsort(*pids, size, sizeof(int), compare_pids);
+    }
+    return size;
+}
+
+// Read the stat of a process in e. Return -1 if it does not exist (anymore).
+int read_diff_entry(int procfs_fd, int pid, char *buf, struct diff_entry *e,
+        struct scan_filter *filter) {
+    struct process proc;
+    char *name;
+    int name_len;
+
+    if (read_pid_stat(procfs_fd, pid, buf, &proc, &name, &name_len) == -1) {
+        return -1;
+    }
+    e->pid = pid;
+    e->ppid = proc.ppid;
+    e->starttime = proc.starttime;
+    e->selected = match_filter(procfs_fd, &proc, name, name_len, filter);
+    if (name_len >= DIFF_NAME_SIZE) { name_len = DIFF_NAME_SIZE - 1; }
+    memcpy(e->name, name, name_len);
+    e->name[name_len] = '\0';
+    return 0;
+}
+
+void display_event(double time, const char *event, struct diff_entry *e,
+        const char *old_name) {
+    if (old_name != NULL) {
+        printf(FORMAT_DIFF, time, event, e->pid, e->ppid, old_name, " -> ", e->name);
+    } else {
+        printf(FORMAT_DIFF, time, event, e->pid, e->ppid, e->name, "", "");
+    }
+}
+
+// Print the processes that started, exited or changed (exec) as a stream of
+// events, every interval seconds, count times (forever if 0).
+//
+// Each sample only lists the PIDs and merges them with the sorted table of
+// the previous sample: only the new PIDs have their stat read. The PIDs still
+// there are assumed to be the same processes, until the verify pass (every
+// DIFF_VERIFY_PERIOD) rereads them all to catch the execs and the PID reuse.
+// A PID listed but gone before its stat is read is reported as BRIEF.
+void diff_processes(int procfs_fd, double interval, int count,
+        struct scan_filter *filter) {
+    char buf[STAT_BUF_SIZE];
+    struct diff_table old = { 0 }, new = { 0 };
+    struct dir_iter it;
+    int *pids = NULL;
+    int pids_capacity = 0;
+    int any_filter = filter->name != NULL || filter->states != NULL || filter->has_uid;
+
+    struct timespec start, next, now, last_verify;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = last_verify = start;
+
+    dir_iter_init(&it, procfs_fd, 0);
+    PRINT_HEADER_DIFF;
+    // The first sample is the baseline and prints nothing.
+    for (unsigned long sample = 0; count == 0 || sample <= (unsigned long) count; sample++) {
+        int npids = list_sorted_pids(&it, procfs_fd, &pids, &pids_capacity);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double time = timespec_diff(&now, &start);
+        int verify = sample > 0 && timespec_diff(&now, &last_verify) >= DIFF_VERIFY_PERIOD;
+        if (verify) { last_verify = now; }
+
+        new.size = 0;
+        int i = 0, j = 0;
+        while (i < old.size || j < npids) {
+            if (j == npids || (i < old.size && old.entries[i].pid < pids[j])) {
+                if (old.entries[i].selected) {
+                    display_event(time, "EXIT", &old.entries[i], NULL);
+                }
+                i++;
+                continue;
+            }
+
+            struct diff_entry *e = diff_table_push(&new);
+            if (i == old.size || pids[j] < old.entries[i].pid) {
+                if (read_diff_entry(procfs_fd, pids[j], buf, e, filter) == -1) {
+                    new.size--;
+                    if (sample > 0 && ! any_filter) {
+                        struct diff_entry gone = { .pid = pids[j], .name = "?" };
+                        display_event(time, "BRIEF", &gone, NULL);
+                    }
+                } else if (sample > 0 && e->selected) {
+                    display_event(time, "START", e, NULL);
+                }
+                j++;
+                continue;
+            }
+
+            // Listed in both samples.
+            *e = old.entries[i];
+            if (verify) {
+                struct diff_entry current;
+                if (read_diff_entry(procfs_fd, pids[j], buf, &current, filter) == -1) {
+                    new.size--;
+                    if (e->selected) { display_event(time, "EXIT", e, NULL); }
+                } else if (current.starttime != e->starttime) {
+                    // The PID was reused between two samples.
+                    if (e->selected) { display_event(time, "EXIT", e, NULL); }
+                    if (current.selected) { display_event(time, "START", &current, NULL); }
+                    *e = current;
+                } else {
+                    if ((e->selected || current.selected) && ! STREQ(e->name, current.name)) {
+                        display_event(time, "CHANGE", &current, e->name);
+                    }
+                    *e = current;
+                }
+            }
+            i++;
+            j++;
+        }
+
+        struct diff_table swap = old;
+        old = new;
+        new = swap;
+        fflush(stdout);
+
+        if (count != 0 && sample == (unsigned long) count) { break; }
+        sleep_until_next(&next, interval);
+    }
+
+    dir_iter_free(&it);
+    free(pids);
+    free(old.entries);
+    free(new.entries);
+}
+
+// ********** Forest functions **********
+
+// Map the PIDs of a table to their index, for the PPid lookups.
+int* build_pid_index(struct process_table *table, int *capacity) {
+    *capacity = 1024;
+    while (*capacity < table->size * 2) { *capacity *= 2; }
+
+    // Index + 1 of the process, 0 for an empty slot.
+    int *slots = calloc(*capacity, sizeof(int));
+    for (int i = 0; i < table->size; i++) {
+        unsigned int h = pid_hash(table->procs[i].pid, *capacity);
+        while (slots[h] != 0) { h = (h + 1) & (*capacity - 1); }
+        slots[h] = i + 1;
+    }
+    return slots;
+}
+
+// Return the index of pid in the table, or -1.
+int lookup_pid_index(struct process_table *table, int *slots, int capacity, int pid) {
+    unsigned int h = pid_hash(pid, capacity);
+    while (slots[h] != 0) {
+        if (table->procs[slots[h] - 1].pid == pid) { return slots[h] - 1; }
+        h = (h + 1) & (capacity - 1);
+    }
+    return -1;
+}
+
+// Display the processes as trees, with the VmSize and RSS totals of each
+// subtree. The children of each process are stored contiguously (CSR), in
+// table order, so everything is built in O(n) passes.
+void display_forest(struct process_table *table) {
+    int n = table->size;
+    int capacity;
+    int *slots = build_pid_index(table, &capacity);
+
+    // Parent of each process, -1 for the roots.
+    int *parent = malloc(n * sizeof(int));
+    // Children of process i are children[first_child[i]..first_child[i+1]].
+    int *first_child = calloc(n + 1, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        struct process *p = &table->procs[i];
+        parent[i] = p->ppid == p->pid ? -1 : lookup_pid_index(table, slots, capacity, p->ppid);
+        if (parent[i] != -1) { first_child[parent[i] + 1]++; }
+    }
+    free(slots);
+    for (int i = 0; i < n; i++) {
+        first_child[i + 1] += first_child[i];
+    }
+    int *children = malloc(n * sizeof(int));
+    int *filled = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        if (parent[i] != -1) {
+            children[first_child[parent[i]] + filled[parent[i]]++] = i;
+        }
+    }
+    free(filled);
+
+    // Preorder walk with an explicit stack, deep trees must not overflow.
+    // The roots come first, then the processes left in PPid cycles (a PID
+    // reused while /proc was scanned), each cycle being broken at its first
+    // process.
+    int *order = malloc(n * sizeof(int));
+    int *depth = malloc(n * sizeof(int));
+    int *stack = malloc(n * sizeof(int));
+    char *visited = calloc(n, 1);
+    int order_size = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int root = 0; root < n; root++) {
+            if (visited[root] || (pass == 0 && parent[root] != -1)) { continue; }
+
+            parent[root] = -1;
+            int stack_size = 0;
+            stack[stack_size++] = root;
+            visited[root] = 1;
+            depth[root] = 0;
+            while (stack_size > 0) {
+                int i = stack[--stack_size];
+                order[order_size++] = i;
+                for (int c = first_child[i + 1] - 1; c >= first_child[i]; c--) {
+                    if (visited[children[c]]) { continue; }
+                    visited[children[c]] = 1;
+                    depth[children[c]] = depth[i] + 1;
+                    stack[stack_size++] = children[c];
+                }
+            }
+        }
+    }
+    free(visited);
+    free(stack);
+
+    // Subtree totals, the children come after their parent in the preorder.
+    unsigned long *vmsize = malloc(n * sizeof(unsigned long));
+    unsigned long *rss = malloc(n * sizeof(unsigned long));
+    for (int i = 0; i < n; i++) {
+        vmsize[i] = table->procs[i].vmsize;
+        rss[i] = table->procs[i].rss;
+    }
+    for (int k = order_size - 1; k >= 0; k--) {
+        int i = order[k];
+        if (parent[i] != -1) {
+            vmsize[parent[i]] += vmsize[i];
+            rss[parent[i]] += rss[i];
+        }
+    }
+
+    PRINT_HEADER_FOREST;
+    for (int k = 0; k < order_size; k++) {
+        int i = order[k];
+        char vmsize_str[32];
+        char rss_str[32];
+        snprintf(vmsize_str, 32, "%lu kB", vmsize[i]);
+        snprintf(rss_str, 32, "%lu kB", rss[i]);
+        printf(FORMAT_FOREST, table->procs[i].pid, vmsize_str, rss_str,
+                depth[i] * 2, "", depth[i] > 0 ? "\\_ " : "", table->procs[i].name);
+    }
+
+    free(vmsize);
+    free(rss);
+    free(order);
+    free(depth);
+    free(children);
+    free(first_child);
+    free(parent);
 }
 
 // ********** Main **********
@@ -241,23 +1377,139 @@ int display_procs(struct process **procs, int all_f, int pid) {
 int main (int argc, char *argv[]) {
     int all_f = 0;
     int c = 0;
-    int pid = 0;
+    // PIDs given with -p, 0 terminated.
+    int *pids = calloc(10, sizeof(int));
+    int pids_size = 0;
+    double interval = 0;
+    int count = 0;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    struct scan_filter filter = { 0 };
+    int forest_f = 0;
+    int threads_f = 0;
+    int fold_f = 0;
+    char *procfs_path = PROCFS_PATH;
+    int diff_f = 0;
 
-    while ((c = getopt_long(argc, argv, "hap:", longopts, NULL)) != -1) {
+    stats_init(argv[0]);
+
+    while ((c = getopt_long(argc, argv, "hap:i:n:j:s:t:N:u:S:fTFP:d", longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 // Help.
-                printf("usage: ps [-a|--all] [-p|--pid pid]\n" \
+                printf("usage: ps [-a|--all] [-p|--pid pid]... [-i|--interval seconds [-n|--count count]]\n" \
+                        "          [-j|--jobs jobs] [-s|--sort key] [-t|--top n]\n" \
+                        "          [-N|--name name] [-u|--user user] [-S|--state states]\n" \
+                        "          [-f|--forest] [-T|--threads [-F|--fold]] [-P|--procfs path]\n" \
+                        "          [-d|--diff [-i|--interval seconds]] [--stats[=file]]\n" \
                         "  ----- Options -----\n" \
                         "  -a\tGet all the informations.\n" \
-                        "  -p\tGive the information about one process.\n");
+                        "  -p\tGive the information about one process, can be repeated.\n" \
+                        "  -i\tDisplay CPU, RSS and IO usage every interval seconds.\n" \
+                        "  -n\tStop the interval mode after count samples.\n" \
+                        "  -j\tScan large process tables with jobs threads.\n" \
+                        "  -s\tSort by vmsize, rss, cpu or pid. With -i, cpu is the usage of the interval.\n" \
+                        "  -t\tOnly display the n first processes.\n" \
+                        "  -N\tOnly display the processes with this name.\n" \
+                        "  -u\tOnly display the processes of this user.\n" \
+                        "  -S\tOnly display the processes in one of these states (e.g. RD).\n" \
+                        "  -f\tDisplay the process trees with the memory of each subtree.\n" \
+                        "  -T\tDisplay the state and CPU usage of each thread.\n" \
+                        "  -F\tFold the threads in per-process totals.\n" \
+                        "  -P\tRead the processes from another procfs root (default " PROCFS_PATH ").\n" \
+                        "  -d\tPrint the processes that start, exit or change, every interval\n" \
+                        "    \tseconds (1 by default).\n" \
+                        "  --stats\tReport the syscall counts and latencies as JSON at exit.\n");
                 return EXIT_SUCCESS;
             case 'a':
                 all_f = 1;
                 break;
             case 'p':
-                // Max directory depth.
-                pid = atoi(optarg);
+                // PID to look up, can be given several times.
+                ;
+                int pid = atoi(optarg);
+                if (pid <= 0) {
+                    fprintf(stderr, "%s: '%s' is not a valid PID.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                if (((pids_size + 1) % 10) == 0) {
+                    pids = realloc(pids, (pids_size + 11) * sizeof(int));
+                }
+                pids[pids_size++] = pid;
+                pids[pids_size] = 0;
+                break;
+            case 'i':
+                // Monitoring mode.
+                interval = strtod(optarg, NULL);
+                if (interval <= 0) {
+                    fprintf(stderr, "%s: '%s' is not a valid interval.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 's':
+                if (STREQ(optarg, "pid")) {
+                    SORT_KEY = SORT_PID;
+                } else if (STREQ(optarg, "vmsize")) {
+                    SORT_KEY = SORT_VMSIZE;
+                } else if (STREQ(optarg, "rss")) {
+                    SORT_KEY = SORT_RSS;
+                } else if (STREQ(optarg, "cpu")) {
+                    SORT_KEY = SORT_CPU;
+                } else {
+                    fprintf(stderr, "%s: '%s' is not a valid sort key.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                filter.top = atoi(optarg);
+                if (filter.top <= 0) {
+                    fprintf(stderr, "%s: '%s' is not a valid top.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                filter.name = optarg;
+                break;
+            case 'u':
+                ;
+                struct passwd *pw = getpwnam(optarg);
+                char *end;
+                filter.has_uid = 1;
+                if (pw != NULL) {
+                    filter.uid = pw->pw_uid;
+                } else {
+                    filter.uid = strtol(optarg, &end, 10);
+                    if (*optarg == '\0' || *end != '\0') {
+                        fprintf(stderr, "%s: '%s' is not a valid user.\n", argv[0], optarg);
+                        return EXIT_FAILURE;
+                    }
+                }
+                break;
+            case 'S':
+                filter.states = optarg;
+                break;
+            case 'f':
+                forest_f = 1;
+                break;
+            case 'T':
+                threads_f = 1;
+                break;
+            case 'F':
+                fold_f = 1;
+                break;
+            case 'P':
+                procfs_path = optarg;
+                break;
+            case 'd':
+                diff_f = 1;
+                break;
+            case STATS_OPT:
+                stats_enable(optarg);
                 break;
             case ':':
                 // Missing option argument
@@ -270,9 +1522,85 @@ int main (int argc, char *argv[]) {
         }
     }
 
-    struct process **procs = get_processes_status();
-    int status = display_procs(procs, all_f, pid);
-    free_processes(procs);
+    if (forest_f && filter.top > 0) {
+        fprintf(stderr, "%s: --forest can't be used with --top.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (threads_f && (forest_f || filter.top > 0 || SORT_KEY != SORT_NONE || interval > 0)) {
+        fprintf(stderr, "%s: --threads can't be used with --forest, --sort, --top or --interval.\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (diff_f && (threads_f || forest_f || filter.top > 0 || SORT_KEY != SORT_NONE ||
+                pids_size != 0)) {
+        fprintf(stderr, "%s: --diff can't be used with --threads, --forest, --sort, --top or --pid.\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (interval > 0 && forest_f) {
+        fprintf(stderr, "%s: --interval can't be used with --forest.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    PAGE_KB = sysconf(_SC_PAGESIZE) / 1024;
+    CLK_TCK = sysconf(_SC_CLK_TCK);
+    if (jobs < 1) { jobs = 1; }
+    if (jobs > MAX_JOBS) { jobs = MAX_JOBS; }
+
+    int procfs_fd = STATS(STATS_OPEN, open(procfs_path, O_RDONLY | O_DIRECTORY));
+    if (procfs_fd == -1) {
+        fprintf(stderr, "%s: unable to open %s.\n", argv[0], procfs_path);
+        return EXIT_FAILURE;
+    }
+
+    if (diff_f) {
+        diff_processes(procfs_fd, interval > 0 ? interval : 1, count, &filter);
+        free(pids);
+        close(procfs_fd);
+        return EXIT_SUCCESS;
+    }
+
+    if (interval > 0) {
+        monitor_processes(procfs_fd, pids_size != 0 ? pids : NULL, interval, count,
+                &filter);
+        free(pids);
+        close(procfs_fd);
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    read_uptime(procfs_fd);
+    if (threads_f) {
+        if (display_threads(procfs_fd, pids_size != 0 ? pids : NULL, &filter, fold_f) != 0) {
+            status = EXIT_FAILURE;
+        }
+        free(pids);
+        close(procfs_fd);
+        return status;
+    }
+
+    struct process_table table = { 0 };
+    if (pids_size == 0) {
+        get_processes_status(&table, procfs_fd, &filter, jobs);
+    } else {
+        // Only open the requested /proc/PID entries.
+        if (get_processes_by_pid(&table, procfs_fd, pids, pids_size, &filter, 1) != 0) {
+            status = EXIT_FAILURE;
+        }
+        sort_processes(&table, &filter);
+    }
+    free(pids);
+    close(procfs_fd);
+
+    if (forest_f) {
+        display_forest(&table);
+    } else {
+        display_procs(&table, all_f);
+    }
+    free_process_table(&table);
 
     return status;
 }
@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
@@ -7,27 +8,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "dir_iter.h"
+#include "snapshot.h"
+#include "stats.h"
+
 #define IGNORE_DIRS_SIZE 10
-#define BUF_SIZE 1024
+#define OUT_BUF_SIZE (256 * 1024)
+
+// Connectors of the box drawing mode.
+#define BOX_TEE    "\u251c\u2500\u2500 " // ├──
+#define BOX_CORNER "\u2514\u2500\u2500 " // └──
+#define BOX_PIPE   "\u2502   "             // │
+#define BOX_SPACE  "    "
 
 struct option longopts[] = {
     {"help", no_argument, 0, 'h'},
     {"ignore", required_argument, 0, 'I'},
     {"level", required_argument, 0, 'L'},
+    {"format", required_argument, 0, 'f'},
+    {"diff", no_argument, 0, 'd'},
+    {"box", no_argument, 0, 'b'},
+    STATS_LONGOPT,
     {0, 0, 0, 0}
 };
 
-struct linux_dirent {
-    long           d_ino;
-    off_t          d_off;
-    unsigned short d_reclen;
-    char           d_name[];
-};
-
 // Define a file or a directory.
 typedef struct inode {
     bool isdir;
@@ -40,12 +47,25 @@ typedef struct inode {
 } INODE;
 
 INODE *TREE;
+int FAILED = 0; // A directory couldn't be read.
+
+// Output of the tree. The prefix of the current depth is kept in a single
+// buffer along the walk, and the lines are gathered in out to be written
+// with a few large writes: nothing is allocated per line.
+struct renderer {
+    bool box;
+    char *prefix;
+    size_t prefix_len;
+    size_t prefix_capacity;
+    char *out;
+    size_t out_len;
+};
 
 // ********** Helper functions **********
 
 int is_directory(int fd) {
     struct stat sb;
-    if (fstat(fd, &sb) == -1) {
+    if (STATS(STATS_STAT, fstat(fd, &sb)) == -1) {
         exit(EXIT_FAILURE);
     }
     return S_ISDIR(sb.st_mode);
@@ -61,89 +81,147 @@ bool is_in_array(char *str, char **array) {
     return false;
 }
 
+// Print the path of an inode, from the directory given to mytree.
+void print_path(FILE *f, INODE *i) {
+    if (i->parent != NULL) {
+        print_path(f, i->parent);
+        size_t len = strlen(i->parent->name);
+        if (len == 0 || i->parent->name[len - 1] != '/') { fputc('/', f); }
+    }
+    fputs(i->name, f);
+}
+
+// Report a directory that can't be read, from errno. The walk goes on.
+void report_error(INODE *i) {
+    int error = errno;
+    fprintf(stderr, "mytree: cannot read ");
+    print_path(stderr, i);
+    fprintf(stderr, ": %s\n", strerror(error));
+    FAILED = 1;
+}
+
 // ********** Inode functions **********
 
-// Set children for a given dir.
-void set_inode_children(INODE *i) {
+// Set children for a given dir, listed from its fd with the iterator of the
+// build, whose buffer is reused from a directory to the next.
+void set_inode_children(INODE *i, struct dir_iter *it) {
     INODE *child = NULL;
     INODE *last_child;
     bool first = true;
+    struct linux_dirent64 *d;
 
     if (! i->isdir) {
         fprintf(stderr, "%s is not a directory.\n", i->name);
     }
 
-    while (1) {
-        char buf[BUF_SIZE];
-        struct linux_dirent *d = NULL;
-        int nread;
-        char d_type;
-
-        nread = syscall(SYS_getdents, i->fd, buf, BUF_SIZE);
-        // Error.
-        if (nread == -1) {
-            exit(EXIT_FAILURE);
-        }
-        // End of read.
-        if (nread == 0) {
-            if (child != NULL) {
-                child->next = NULL;
-            } else {
-                i->children = NULL;
-            }
-            break;
+    i->children = NULL;
+    dir_iter_reset(it, i->fd, DIR_ITER_SKIP_DOTS);
+    while ((d = dir_iter_next(it)) != NULL) {
+        child = malloc(sizeof(INODE));
+        child->name = malloc(strlen(d->d_name) + 1);
+        strncpy(child->name, d->d_name, strlen(d->d_name));
+        child->name[strlen(d->d_name)] = '\0';
+
+        child->isdir = (dir_entry_type(i->fd, d) == DT_DIR);
+        child->depth = i->depth + 1;
+        child->parent = i;
+        child->next = NULL;
+        child->children = NULL;
+        // Opened when its turn to be listed comes.
+        child->fd = -1;
+
+        if (first) {
+            i->children = child;
+            first = false;
+        } else {
+            last_child->next = child;
         }
 
-        for (int bpos = 0; bpos < nread; bpos += d->d_reclen) {
-            d = (struct linux_dirent *) (buf + bpos);
-            d_type = *(buf + bpos + d->d_reclen - 1);
-
-            if (strncmp(d->d_name, ".", 2) == 0 || strncmp(d->d_name, "..", 3) == 0) {
-                continue;
-            }
+        last_child = child;
+    }
+    if (it->error != 0) {
+        errno = it->error;
+        report_error(i);
+    }
+}
 
-            child = malloc(sizeof(INODE));
-            child->name = malloc(strlen(d->d_name) + 1);
-            strncpy(child->name, d->d_name, strlen(d->d_name));
-            child->name[strlen(d->d_name)] = '\0';
+// ********** Render functions **********
 
-            child->isdir = (d_type == DT_DIR);
-            child->depth = i->depth + 1;
-            child->parent = i;
+void renderer_init(struct renderer *r, bool box) {
+    r->box = box;
+    r->prefix = NULL;
+    r->prefix_len = 0;
+    r->prefix_capacity = 0;
+    r->out = malloc(OUT_BUF_SIZE);
+    r->out_len = 0;
+}
 
-            // Get the fd for the child only if the child is a dir.
-            child->fd = -1;
-            if (child->isdir) {
-                child->fd = openat(i->fd, child->name, O_RDONLY);
-            }
+void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = STATS(STATS_WRITE, write(STDOUT_FILENO, buf, len));
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            // Nobody is reading anymore (EPIPE) or the disk is full.
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
 
-            if (first) {
-                i->children = child;
-                first = false;
-            } else {
-                last_child->next = child;
-            }
+void renderer_flush(struct renderer *r) {
+    write_all(r->out, r->out_len);
+    r->out_len = 0;
+}
 
-            last_child = child;
+// Append to the output. Data larger than the buffer (a huge prefix) is
+// written directly.
+void render(struct renderer *r, const char *data, size_t len) {
+    if (len == 0) { return; }
+    if (r->out_len + len > OUT_BUF_SIZE) {
+        renderer_flush(r);
+        if (len > OUT_BUF_SIZE) {
+            write_all(data, len);
+            return;
         }
     }
+    memcpy(r->out + r->out_len, data, len);
+    r->out_len += len;
 }
 
-void print_inode(INODE *i) {
-    char *str = calloc(100, sizeof(char));
-    int offset;
-    for (offset = 0; offset < i->depth * 2; offset++) {
-        str[offset] = ' ';
+// Extend the prefix for the children of an entry, return the length to
+// restore on the way back up.
+size_t push_prefix(struct renderer *r, const char *str) {
+    size_t old_len = r->prefix_len;
+    size_t len = strlen(str);
+    if (r->prefix_len + len > r->prefix_capacity) {
+        r->prefix_capacity = (r->prefix_len + len) * 2;
+        r->prefix = realloc(r->prefix, r->prefix_capacity);
     }
-    str[offset] = '\0';
-    strcat(str, i->name);
-    if (i->isdir) {
-        offset += strlen(i->name);
-        str[offset] = '/';
-        str[offset+1] = '\0';
+    memcpy(r->prefix + r->prefix_len, str, len);
+    r->prefix_len += len;
+    return old_len;
+}
+
+// Print an inode: the prefix of its depth, its connector (none for the
+// root) and its name, with a / for the directories.
+void print_inode(struct renderer *r, INODE *i, bool last) {
+    render(r, r->prefix, r->prefix_len);
+    if (i->depth > 0) {
+        if (r->box) {
+            render(r, last ? BOX_CORNER : BOX_TEE, strlen(last ? BOX_CORNER : BOX_TEE));
+        } else {
+            render(r, "  ", 2);
+        }
     }
-    printf("%s\n", str);
-    free(str);
+    render(r, i->name, strlen(i->name));
+    render(r, i->isdir ? "/\n" : "\n", i->isdir ? 2 : 1);
+}
+
+void renderer_free(struct renderer *r) {
+    renderer_flush(r);
+    free(r->prefix);
+    free(r->out);
 }
 
 
@@ -154,42 +232,135 @@ void free_inode(INODE *i) {
     free(i);
 }
 
+int compare_inodes(const void *a, const void *b) {
+    return strcmp((*(INODE * const *) a)->name, (*(INODE * const *) b)->name);
+}
+
+// Sort a list of siblings by name, return the new first one.
+INODE* sort_siblings(INODE *first) {
+    size_t count = 0;
+    for (INODE *i = first; i != NULL; i = i->next) { count++; }
+    if (count < 2) { return first; }
+
+    INODE **array = malloc(count * sizeof(INODE *));
+    count = 0;
+    for (INODE *i = first; i != NULL; i = i->next) { array[count++] = i; }
+    qsort(array, count, sizeof(INODE *), compare_inodes);
+    for (size_t k = 0; k + 1 < count; k++) { array[k]->next = array[k + 1]; }
+    array[count - 1]->next = NULL;
+
+    first = array[0];
+    free(array);
+    return first;
+}
+
+// Add an inode to a snapshot, with the size and mode of its stat. dir_fd is
+// its parent directory, unused for the root.
+void snapshot_inode(struct snapshot_writer *w, INODE *i, int dir_fd) {
+    struct stat sb;
+    int ret = i->parent == NULL
+        ? STATS(STATS_STAT, fstat(i->fd, &sb))
+        : STATS(STATS_STAT, fstatat(dir_fd, i->name, &sb, AT_SYMLINK_NOFOLLOW));
+    if (ret == -1) {
+        // Removed since the listing.
+        return;
+    }
+    snapshot_add(w, i->name, i->depth, IFTODT(sb.st_mode), sb.st_size, sb.st_mode);
+}
+
 // ********** Recursive traversing tree functions **********
 
-// Recursively build the tree by setting children for dir tree.
-void recurse_build_tree(INODE *i) {
+// Open a subdirectory relative to its parent, which must be open.
+int open_inode(INODE *i, int dir_fd) {
+    int fd = STATS(STATS_OPEN, openat(dir_fd, i->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW));
+    if (fd == -1) {
+        report_error(i);
+    }
+    return fd;
+}
+
+// Recursively build the tree by setting children for dir tree. A directory
+// is only open while it is listed and its subdirectories are built, so the
+// open fds are bounded by the depth. A directory is fully listed before its
+// subdirectories, so they all share the iterator it.
+void recurse_build_tree(INODE *i, struct dir_iter *it) {
     INODE *gremlin = i;
     while(1) {
         if (gremlin == NULL) { return; }
         if (gremlin->isdir) {
-            set_inode_children(gremlin);
-            recurse_build_tree(gremlin->children);
+            // The root is already open.
+            if (gremlin->parent != NULL) {
+                gremlin->fd = open_inode(gremlin, gremlin->parent->fd);
+            }
+            if (gremlin->fd != -1) {
+                set_inode_children(gremlin, it);
+                recurse_build_tree(gremlin->children, it);
+            }
+            if (gremlin->parent != NULL && gremlin->fd != -1) {
+                close(gremlin->fd);
+                gremlin->fd = -1;
+            }
         }
         gremlin = gremlin->next;
     }
 }
 
-void recursive_print_tree(INODE *i, int max_depth, char **ignore_dirs) {
+// Find the first sibling from i that is not ignored.
+INODE* next_shown(INODE *i, char **ignore_dirs) {
+    while (i != NULL && is_in_array(i->name, ignore_dirs)) {
+        i = i->next;
+    }
+    return i;
+}
+
+void recursive_print_tree(INODE *i, int max_depth, char **ignore_dirs, struct renderer *r) {
     // Check if directory is not empty.
     if (i == NULL) { return; }
 
     // Check for cli options.
     if (i->depth + 1 >= max_depth) { return; }
 
-    INODE *gremlin = i;
-    while(1) {
-        if (gremlin == NULL) { break; }
+    // Looking one shown sibling ahead tells which one is the last.
+    INODE *gremlin = next_shown(i, ignore_dirs);
+    while (gremlin != NULL) {
+        INODE *next = next_shown(gremlin->next, ignore_dirs);
+        print_inode(r, gremlin, next == NULL);
 
-        bool found = is_in_array(gremlin->name, ignore_dirs);
-        if (! found) {
-            print_inode(gremlin);
+        if (gremlin->isdir) {
+            size_t len = 0;
+            if (gremlin->depth > 0) {
+                len = push_prefix(r, ! r->box ? "  " : next == NULL ? BOX_SPACE : BOX_PIPE);
+            }
+            recursive_print_tree(gremlin->children, max_depth, ignore_dirs, r);
+            r->prefix_len = len;
         }
 
-        if (gremlin->isdir && ! found) {
-            recursive_print_tree(gremlin->children, max_depth, ignore_dirs);
+        gremlin = next;
+    }
+}
+
+// Same walk as recursive_print_tree(), into a snapshot with the siblings
+// sorted by name. The directories are reopened, relative to dir_fd, their
+// parent, to stat their entries.
+void recursive_snapshot_tree(INODE *i, int dir_fd, int max_depth, char **ignore_dirs,
+        struct snapshot_writer *w) {
+    if (i == NULL) { return; }
+    if (i->depth + 1 >= max_depth) { return; }
+
+    for (INODE *gremlin = i; gremlin != NULL; gremlin = gremlin->next) {
+        if (is_in_array(gremlin->name, ignore_dirs)) { continue; }
+
+        snapshot_inode(w, gremlin, dir_fd);
+        if (! gremlin->isdir || gremlin->children == NULL ||
+                gremlin->depth + 2 >= max_depth) {
+            continue;
         }
 
-        gremlin = gremlin->next;
+        int fd = gremlin->parent == NULL ? gremlin->fd : open_inode(gremlin, dir_fd);
+        if (fd == -1) { continue; }
+        gremlin->children = sort_siblings(gremlin->children);
+        recursive_snapshot_tree(gremlin->children, fd, max_depth, ignore_dirs, w);
+        if (fd != gremlin->fd) { close(fd); }
     }
 }
 
@@ -215,7 +386,11 @@ void recurse_free_tree(INODE *i) {
 // Build a directory tree from a pathname.
 int init_tree(char *name) {
     // Get the file descriptor.
-    int fd = open(name, O_RDONLY);
+    int fd = STATS(STATS_OPEN, open(name, O_RDONLY));
+    if (fd == -1) {
+        fprintf(stderr, "mytree: cannot open %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     // Initialize the first inode.
     TREE = malloc(sizeof(INODE));
     if (! is_directory(fd)) {
@@ -234,33 +409,190 @@ int init_tree(char *name) {
     TREE->children = NULL;
     TREE->depth = 0;
 
-    recurse_build_tree(TREE);
+    struct dir_iter it = { .buf = NULL };
+    recurse_build_tree(TREE, &it);
+    dir_iter_free(&it);
     return 0;
 }
 
-void print_tree(int depth, char **ignore_dirs) {
-    recursive_print_tree(TREE, depth, ignore_dirs);
+void print_tree(int depth, char **ignore_dirs, struct renderer *r) {
+    recursive_print_tree(TREE, depth, ignore_dirs, r);
+}
+
+// Write the tree as a binary snapshot on stdout.
+int write_tree_snapshot(int depth, char **ignore_dirs) {
+    struct snapshot_writer w;
+    snapshot_writer_init(&w);
+    recursive_snapshot_tree(TREE, AT_FDCWD, depth, ignore_dirs, &w);
+    int ret = snapshot_write(&w, STDOUT_FILENO);
+    snapshot_writer_free(&w);
+    return ret;
 }
 
 void free_tree() {
     recurse_free_tree(TREE);
 }
 
+// ********** Snapshot diff functions **********
+
+// Walk of a snapshot in preorder, keeping the path of the current entry
+// relative to the root.
+struct snapshot_walk {
+    struct snapshot s;
+    struct snapshot_cursor c;
+    uint64_t index;  // Of the current entry, s.count at the end.
+    char *path;
+    size_t path_capacity;
+    size_t *ends;    // Length of the path at each depth.
+    size_t ends_capacity;
+};
+
+// Move to the next entry. Return -1 if the snapshot is corrupted.
+int snapshot_walk_next(struct snapshot_walk *w) {
+    if (++w->index >= w->s.count) {
+        w->index = w->s.count;
+        return 0;
+    }
+    const char *name = snapshot_cursor_next(&w->c);
+    uint32_t depth = w->s.depth[w->index];
+    // A single root, and no level skipped on the way down.
+    if (name == NULL || depth == 0 || depth > w->s.depth[w->index - 1] + 1) {
+        return -1;
+    }
+
+    if (depth >= w->ends_capacity) {
+        w->ends_capacity = depth * 2;
+        w->ends = realloc(w->ends, w->ends_capacity * sizeof(size_t));
+    }
+    size_t start = depth == 1 ? 0 : w->ends[depth - 1] + 1;
+    size_t len = start + strlen(name);
+    if (len + 1 > w->path_capacity) {
+        w->path_capacity = (len + 1) * 2;
+        w->path = realloc(w->path, w->path_capacity);
+    }
+    if (depth > 1) { w->path[start - 1] = '/'; }
+    strcpy(w->path + start, name);
+    w->ends[depth] = len;
+    return 0;
+}
+
+int snapshot_walk_open(struct snapshot_walk *w, const char *file) {
+    memset(w, 0, sizeof(struct snapshot_walk));
+    if (snapshot_open(&w->s, file) == -1) { return -1; }
+    if (w->s.count == 0 || w->s.depth[0] != 0) {
+        snapshot_close(&w->s);
+        errno = EINVAL;
+        return -1;
+    }
+    // Skip the root, its name is the path given to mytree.
+    snapshot_cursor_init(&w->c, &w->s, 0);
+    snapshot_cursor_next(&w->c);
+    return snapshot_walk_next(w);
+}
+
+void snapshot_walk_close(struct snapshot_walk *w) {
+    snapshot_cursor_free(&w->c);
+    snapshot_close(&w->s);
+    free(w->path);
+    free(w->ends);
+}
+
+// Compare two paths in the order of a preorder walk with sorted siblings:
+// like strcmp(), but '/' is lower than any other character.
+int compare_paths(const char *a, const char *b) {
+    for ( ; *a == *b; a++, b++) {
+        if (*a == '\0') { return 0; }
+    }
+    int rank_a = *a == '/' ? 1 : *a == '\0' ? 0 : (unsigned char) *a + 1;
+    int rank_b = *b == '/' ? 1 : *b == '\0' ? 0 : (unsigned char) *b + 1;
+    return rank_a - rank_b;
+}
+
+void print_entry(char sign, struct snapshot_walk *w) {
+    printf("%c %s%s\n", sign, w->path, w->s.type[w->index] == DT_DIR ? "/" : "");
+}
+
+// Print the differences between two snapshots. Return 0 if they are the
+// same, 1 if they differ and 2 on error, like diff(1).
+int diff_snapshots(const char *file_a, const char *file_b) {
+    struct snapshot_walk a, b;
+    if (snapshot_walk_open(&a, file_a) == -1) {
+        fprintf(stderr, "mytree: can't read the snapshot %s: %s\n", file_a, strerror(errno));
+        return 2;
+    }
+    if (snapshot_walk_open(&b, file_b) == -1) {
+        fprintf(stderr, "mytree: can't read the snapshot %s: %s\n", file_b, strerror(errno));
+        snapshot_walk_close(&a);
+        return 2;
+    }
+
+    int status = 0;
+    while (a.index < a.s.count || b.index < b.s.count) {
+        int cmp = a.index == a.s.count ? 1
+            : b.index == b.s.count ? -1
+            : compare_paths(a.path, b.path);
+        if (cmp < 0) {
+            print_entry('-', &a);
+            status = 1;
+        } else if (cmp > 0) {
+            print_entry('+', &b);
+            status = 1;
+        } else if (a.s.type[a.index] != b.s.type[b.index]) {
+            print_entry('-', &a);
+            print_entry('+', &b);
+            status = 1;
+        } else if (a.s.mode[a.index] != b.s.mode[b.index] ||
+                // The size of directories depends on the filesystem history.
+                (a.s.type[a.index] != DT_DIR && a.s.size[a.index] != b.s.size[b.index])) {
+            printf("~ %s%s: mode %04o -> %04o, size %llu -> %llu\n", b.path,
+                    b.s.type[b.index] == DT_DIR ? "/" : "",
+                    a.s.mode[a.index] & 07777, b.s.mode[b.index] & 07777,
+                    (unsigned long long) a.s.size[a.index],
+                    (unsigned long long) b.s.size[b.index]);
+            status = 1;
+        }
+
+        const char *corrupted = NULL;
+        if (cmp <= 0 && snapshot_walk_next(&a) == -1) { corrupted = file_a; }
+        if (cmp >= 0 && snapshot_walk_next(&b) == -1) { corrupted = file_b; }
+        if (corrupted != NULL) {
+            fprintf(stderr, "mytree: the snapshot %s is corrupted\n", corrupted);
+            status = 2;
+            break;
+        }
+    }
+
+    snapshot_walk_close(&a);
+    snapshot_walk_close(&b);
+    return status;
+}
+
 // ********** Main **********
 
 int main (int argc, char *argv[]) {
     int c;
     int depth = INT_MAX;
     char *ignore_dirs[IGNORE_DIRS_SIZE] = {0};
+    int bin_f = 0;
+    int diff_f = 0;
+    bool box_f = false;
 
-    while ((c = getopt_long(argc, argv, "hI:L:", longopts, NULL)) != -1) {
+    stats_init(argv[0]);
+
+    while ((c = getopt_long(argc, argv, "hI:L:f:db", longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 // Help.
-                printf("usage: tree [-I|--ignore dir] [-L|--level level] [--] [directory list]\n" \
+                printf("usage: tree [-I|--ignore dir] [-L|--level level] [-f|--format text|bin]\n" \
+                        "            [-b|--box] [--stats[=file]] [--] [directory list]\n" \
+                        "       tree -d|--diff snapshot snapshot\n" \
                         "  ----- Options -----\n" \
                         "  -I\tDo not list directory equals to dir.\n" \
-                        "  -L\tDescend only level directories deep.\n");
+                        "  -L\tDescend only level directories deep.\n" \
+                        "  -b\tDraw the branches with box drawing characters.\n" \
+                        "  -f\tWrite a binary snapshot of one directory with 'bin'.\n" \
+                        "  -d\tCompare two snapshots, without reading the directories.\n" \
+                        "  --stats\tReport the syscall counts and latencies as JSON at exit.\n");
                 return EXIT_SUCCESS;
             case 'I':
                 // Directory to ignore.
@@ -278,6 +610,23 @@ int main (int argc, char *argv[]) {
                 // Max directory depth.
                 depth = atoi(optarg);
                 break;
+            case 'f':
+                if (strcmp(optarg, "bin") == 0) {
+                    bin_f = 1;
+                } else if (strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "%s: '%s' is not a valid format.\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                diff_f = 1;
+                break;
+            case 'b':
+                box_f = true;
+                break;
+            case STATS_OPT:
+                stats_enable(optarg);
+                break;
             case ':':
                 // Missing option argument
                 fprintf(stderr, "%s: option '-%c' requires an argument.\n", argv[0], optopt);
@@ -289,22 +638,56 @@ int main (int argc, char *argv[]) {
         }
     }
 
+    if (diff_f) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "%s: --diff needs two snapshots.\n", argv[0]);
+            return 2;
+        }
+        return diff_snapshots(argv[optind], argv[optind + 1]);
+    }
+
+    if (bin_f) {
+        if (argc - optind > 1) {
+            fprintf(stderr, "%s: --format=bin takes a single directory.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "%s: not writing a binary snapshot to a terminal.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        init_tree(argc - optind == 0 ? "." : argv[optind]);
+        int ret = write_tree_snapshot(depth, ignore_dirs);
+        free_tree();
+        if (ret == -1) {
+            fprintf(stderr, "%s: can't write the snapshot: %s\n", argv[0], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        return FAILED ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    struct renderer r;
+    renderer_init(&r, box_f);
+
     // Run the command for the current directory.
     if (argc - optind == 0) {
         init_tree(".");
-        print_tree(depth, ignore_dirs);
+        print_tree(depth, ignore_dirs, &r);
         free_tree();
-        return EXIT_SUCCESS;
+        renderer_free(&r);
+        return FAILED ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 
     for (int i = optind; i < argc; i++) {
         init_tree(argv[i]);
-        print_tree(depth, ignore_dirs);
+        print_tree(depth, ignore_dirs, &r);
         free_tree();
+        // The next directory may not exist, which exits.
+        renderer_flush(&r);
         // Linebreak to split differents paths.
         if (i == optind && (i+1) != argc) {
-            printf("\n");
+            render(&r, "\n", 1);
         }
     }
-    return EXIT_SUCCESS;
+    renderer_free(&r);
+    return FAILED ? EXIT_FAILURE : EXIT_SUCCESS;
 }